@@ -61,6 +61,7 @@ public:
 
 	unsigned GetCyclesPerFrame (void) const;
 	unsigned GetNoVSyncDelay (void) const;
+	unsigned GetGCPause (void) const;
 	int GetNTPSyncIntervalMinutes (void) const;
 
 	static CKernelOptions *Get (void);
@@ -113,6 +114,7 @@ private:
 
 	unsigned m_CyclesPerFrame;
 	unsigned m_NoVSyncDelay;
+	unsigned m_GCPause;
 	int m_NTPSyncIntervalMinutes;
 
 	static CKernelOptions *s_pThis;
@@ -44,6 +44,7 @@ CKernelOptions::CKernelOptions (void)
 	m_nBootMode (0),
 	m_CyclesPerFrame (1800),
 	m_NoVSyncDelay(0),
+	m_GCPause(2),
 	m_NTPSyncIntervalMinutes(-1)
 {
 	strcpy (m_LogDevice, "tty1");
@@ -232,6 +233,15 @@ CKernelOptions::CKernelOptions (void)
 				m_NoVSyncDelay = nValue;
 			}
 		}
+		else if (strcmp (pOption, "gcpause") == 0)
+		{
+			unsigned nValue;
+			if (   (nValue = GetDecimal (pValue)) != INVALID_VALUE
+			    && 0 <= nValue && nValue <= 100)  // default is 2 (ms per frame), 0 turns the incremental collector off
+			{
+				m_GCPause = nValue;
+			}
+		}
 		else if (strcmp (pOption, "ntp") == 0)
 		{
 			unsigned nValue;
@@ -354,6 +364,11 @@ unsigned CKernelOptions::GetNoVSyncDelay (void) const
 	return m_NoVSyncDelay;
 }
 
+unsigned CKernelOptions::GetGCPause (void) const
+{
+	return m_GCPause;
+}
+
 int CKernelOptions::GetNTPSyncIntervalMinutes (void) const
 {
 	return m_NTPSyncIntervalMinutes;
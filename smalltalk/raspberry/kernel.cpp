@@ -152,6 +152,7 @@ void CKernel::smalltalk (void)
 	vm_options.three_buttons = true;
 	vm_options.vsync = false;
 	vm_options.novsync_delay = m_Options.GetNoVSyncDelay();
+	vm_options.gc_pause = m_Options.GetGCPause();
 		// Try -delay 8 arg if your CPU is unhappy
 	vm_options.cycles_per_frame = m_Options.GetCyclesPerFrame();
 		// 1800;
@@ -108,6 +108,13 @@ public:
 
 
     bool copyBits();
+    
+    // Move the destination for the next copyBits (drawLoopX:Y:)
+    inline void setDestination(int x, int y)
+    {
+        destX = x;
+        destY = y;
+    }
 
     void getUpdatedBounds(int *boundsX, int *boundsY, int *boundsWidth, int *boundsHeight)
     {
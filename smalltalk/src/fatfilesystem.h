@@ -241,6 +241,14 @@ public:
 #endif
     }
     
+    bool preallocate(int file_handle, int length)
+    {
+        if (fdtofil[file_handle] != NO_FIL) {
+            // Allocate now (opt 1), f_expand fails unless the clusters are contiguous
+            return f_expand(fdtofil[file_handle], length, 1) == FR_OK;
+        } else { return false; }
+    }
+    
     bool is_directory(const char *name)
     {
         FILINFO fi;
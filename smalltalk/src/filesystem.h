@@ -62,6 +62,8 @@ public:
     virtual bool truncate_to(int file_handle, int length) = 0;
     virtual int  file_size(int file_handle) = 0;
     virtual bool file_flush(int file_handle) = 0;
+    // Reserve contiguous space for a new, empty file
+    virtual bool preallocate(int file_handle, int length) = 0;
 
     // Directory orientated operations
     virtual void enumerate_files(const std::function <void (const char *) >& each) = 0;
@@ -31,6 +31,7 @@
 #include <cstdlib>
 #include <cmath>
 #include <limits>
+#include <algorithm>
 #include "oops.h"
 #include "interpreter.h"
 #include "bitblt.h"
@@ -55,7 +56,30 @@ Interpreter::Interpreter(IHardwareAbstractionLayer *halInterface, IFileSystem *f
 bool Interpreter::init()
 {
     initializeMethodCache();
-    semaphoreIndex = -1;
+    sliceInterrupted = false;
+#ifdef CONTEXT_FRAME_STACK
+    frameStackTop[0] = 0;
+    frameStackTop[1] = 0;
+#endif
+    methodCacheHits = 0;
+    methodCacheMisses = 0;
+    sendSiteHits = 0;
+    sendSiteMisses = 0;
+#ifdef QUICK_SEND_BYPASS
+    newMethodQuickKind = NotQuick;
+#endif
+#ifdef THREADED_DISPATCH
+    initializeBytecodeTable();
+#endif
+#ifdef BYTECODE_BENCHMARK
+    bytecodesExecuted = 0;
+    benchmarkStartCount = 0;
+    benchmarkStartTime = hal->get_msclock();
+#endif
+    semaphoreListHead = 0;
+    semaphoreListTail = 0;
+    for (int i = 0; i < SemaphoreListSize; i++)
+        semaphoreList[i].store(0, std::memory_order_relaxed);
     if (!memory.loadSnapshot(fileSystem, hal->get_image_name()))
         return false;
     /*
@@ -65,6 +89,9 @@ bool Interpreter::init()
     activeContext = firstContext();
     memory.increaseReferencesTo(activeContext);
     fetchContextRegisters();
+#ifdef BYTECODE_BENCHMARK
+    benchmarkContextStores();
+#endif
     checkLowMemory = false;
     memoryIsLow = false;
     lowSpaceSemaphore = NilPointer;
@@ -93,6 +120,13 @@ void Interpreter::prepareForCollection()
     {
         memory.addRoot(newProcess);
     }
+#ifdef CONTEXT_FRAME_STACK
+    for(int large = 0; large < 2; large++)
+    {
+        for(int i = 0; i < frameStackTop[large]; i++)
+            memory.addRoot(frameStack[large][i]);
+    }
+#endif
     
 }
 void Interpreter::collectionCompleted()
@@ -103,6 +137,13 @@ void Interpreter::collectionCompleted()
     {
         memory.increaseReferencesTo(newProcess);
     }
+#ifdef CONTEXT_FRAME_STACK
+    for(int large = 0; large < 2; large++)
+    {
+        for(int i = 0; i < frameStackTop[large]; i++)
+            memory.increaseReferencesTo(frameStack[large][i]);
+    }
+#endif
 }
 #endif
 
@@ -997,6 +1038,9 @@ void Interpreter::primitiveSnapshot()
     memory.storePointer_ofObject_withValue(SuspendedContextIndex, activeProcess, activeContext);
     storeContextRegisters();
 
+#ifdef CONTEXT_FRAME_STACK
+    releaseFrames(); // don't save idle contexts
+#endif
     memory.garbageCollect();
     memory.saveSnapshot(fileSystem, hal->get_image_name());
     
@@ -1011,6 +1055,31 @@ void Interpreter::primitiveSnapshot()
     push(NilPointer); //  return of nil signals we just saved
 }
 
+#ifdef DELTA_SNAPSHOTS
+void Interpreter::primitiveDeltaSnapshot()
+{
+    // As primitiveSnapshot, but only what changed since the snapshot was
+    // loaded or saved in full is written, to name.delta. There is no garbage
+    // collection first, cyclic garbage is saved along and collected after
+    // loading. Without a base to refer to, the snapshot is saved in full.
+    int activeProcess = memory.fetchPointer_ofObject(ActiveProcessIndex, schedulerPointer());
+    memory.storePointer_ofObject_withValue(SuspendedContextIndex, activeProcess, activeContext);
+    storeContextRegisters();
+
+#ifdef CONTEXT_FRAME_STACK
+    releaseFrames(); // don't save idle contexts
+#endif
+    if (!memory.saveDeltaSnapshot(fileSystem, hal->get_image_name()))
+    {
+        memory.garbageCollect();
+        memory.saveSnapshot(fileSystem, hal->get_image_name());
+    }
+    
+    pop(1); // see primitiveSnapshot
+    push(NilPointer);
+}
+#endif
+
 void Interpreter::primitiveTimeWordsInto()
 {
     /*
@@ -1251,15 +1320,182 @@ void Interpreter::primitiveScanCharacters()
 
 void Interpreter::primitiveDrawLoop()
 {
-    // optional
-    primitiveFail();
+    // BitBlt>>drawLoopX:Y: -- the Bresenham loop of the Smalltalk fallback,
+    // with one copyBits per point and destX/destY left at the end point
+    int bitBltPointer = stackValue(2);
+    int xDelta = stackIntegerValue(1);
+    int yDelta = stackIntegerValue(0);
+    int destForm = memory.fetchPointer_ofObject(DestFormIndex, bitBltPointer);
+    int destX = fetchInteger_ofObject(DestXIndex, bitBltPointer);
+    int destY = fetchInteger_ofObject(DestYIndex, bitBltPointer);
+    int rule = fetchInteger_ofObject(CombinationRuleIndex, bitBltPointer);
+    int dx, dy, px, py, P;
+    
+    success(between_and(rule, 0, 15));
+    if (success())
+    {
+        // the end point is stored back as SmallIntegers
+        success(memory.isIntegerValue(destX + xDelta) && memory.isIntegerValue(destY + yDelta));
+    }
+    if (!success())
+        return;
+    
+    BitBlt bitBlt(memory,
+                  destForm,
+                  memory.fetchPointer_ofObject(SourceFormIndex, bitBltPointer),
+                  memory.fetchPointer_ofObject(HalftoneFormIndex, bitBltPointer),
+                  rule,
+                  destX,
+                  destY,
+                  fetchInteger_ofObject(WidthIndex, bitBltPointer),
+                  fetchInteger_ofObject(HeightIndex, bitBltPointer),
+                  fetchInteger_ofObject(SourceXIndex, bitBltPointer),
+                  fetchInteger_ofObject(SourceYIndex, bitBltPointer),
+                  fetchInteger_ofObject(ClipXIndex, bitBltPointer),
+                  fetchInteger_ofObject(ClipYIndex, bitBltPointer),
+                  fetchInteger_ofObject(ClipWidthIndex, bitBltPointer),
+                  fetchInteger_ofObject(ClipHeightIndex, bitBltPointer));
+    if (!success())
+        return;
+    
+    // Union of the areas touched, for a single display update
+    int left = 0, top = 0, right = 0, bottom = 0;
+    auto copyBits = [&]()
+    {
+        int updatedX, updatedY, updatedWidth, updatedHeight;
+        
+        bitBlt.setDestination(destX, destY);
+        bitBlt.copyBits();
+        bitBlt.getUpdatedBounds(&updatedX, &updatedY, &updatedWidth, &updatedHeight);
+        if (updatedWidth <= 0 || updatedHeight <= 0)
+            return;
+        if (right <= left)
+        {
+            left = updatedX;
+            top = updatedY;
+            right = updatedX + updatedWidth;
+            bottom = updatedY + updatedHeight;
+            return;
+        }
+        left = std::min(left, updatedX);
+        top = std::min(top, updatedY);
+        right = std::max(right, updatedX + updatedWidth);
+        bottom = std::max(bottom, updatedY + updatedHeight);
+    };
+    
+    dx = xDelta > 0 ? 1 : xDelta < 0 ? -1 : 0;
+    dy = yDelta > 0 ? 1 : yDelta < 0 ? -1 : 0;
+    px = std::abs(yDelta);
+    py = std::abs(xDelta);
+    copyBits();
+    if (py > px)
+    {
+        // more horizontal
+        P = py / 2;
+        for(int i = 1; i <= py; i++)
+        {
+            destX += dx;
+            if ((P -= px) < 0)
+            {
+                destY += dy;
+                P += py;
+            }
+            copyBits();
+        }
+    }
+    else
+    {
+        // more vertical
+        P = px / 2;
+        for(int i = 1; i <= px; i++)
+        {
+            destY += dy;
+            if ((P -= py) < 0)
+            {
+                destX += dx;
+                P += px;
+            }
+            copyBits();
+        }
+    }
+    
+    storeInteger_ofObject_withValue(DestXIndex, bitBltPointer, destX);
+    storeInteger_ofObject_withValue(DestYIndex, bitBltPointer, destY);
+    if (destForm == currentDisplay && right > left)
+        updateDisplay(destForm, left, top, right - left, bottom - top);
+    pop(2); // answer the receiver
 }
 
 void Interpreter::primitiveStringReplace()
 {
-    // optional
-    primitiveFail();
-
+    // replaceFrom: start to: stop with: replacement startingAt: repStart
+    // Elements are copied first to last like the Smalltalk fallback does, so
+    // overlapping ranges of the same object behave the same
+    int array = stackValue(4);
+    int start = stackIntegerValue(3);
+    int stop = stackIntegerValue(2);
+    int replacement = stackValue(1);
+    int repStart = stackIntegerValue(0);
+    int arrayClass;
+    int replacementClass;
+    int count;
+    
+    success(!memory.isIntegerObject(array) && !memory.isIntegerObject(replacement));
+    if (!success())
+        return;
+    
+    arrayClass = memory.fetchClassOf(array);
+    replacementClass = memory.fetchClassOf(replacement);
+    success(isIndexable(arrayClass) && isIndexable(replacementClass));
+    success(isPointers(arrayClass) == isPointers(replacementClass));
+    success(isWords(arrayClass) == isWords(replacementClass));
+    
+    count = stop - start + 1;
+    if (success() && count > 0)
+    {
+        success(start >= 1 && repStart >= 1);
+        success(stop + fixedFieldsOf(arrayClass) <= lengthOf(array));
+        success(repStart + count - 1 + fixedFieldsOf(replacementClass) <= lengthOf(replacement));
+    }
+    if (!success())
+        return;
+    
+    if (count > 0)
+    {
+        if (isPointers(arrayClass))
+        {
+            // storePointer: keeps the reference counts right
+            int to = start - 1 + fixedFieldsOf(arrayClass);
+            int from = repStart - 1 + fixedFieldsOf(replacementClass);
+            
+            for(int i = 0; i < count; i++)
+                memory.storePointer_ofObject_withValue(to + i, array,
+                    memory.fetchPointer_ofObject(from + i, replacement));
+        }
+        else if (isWords(arrayClass))
+        {
+            std::uint16_t *to = memory.fieldAddressOf(array) + start - 1;
+            const std::uint16_t *from = memory.fieldAddressOf(replacement) + repStart - 1;
+            
+            for(int i = 0; i < count; i++)
+                to[i] = from[i];
+#ifdef DELTA_SNAPSHOTS
+            memory.markDirty(to, count * sizeof(std::uint16_t));
+#endif
+        }
+        else
+        {
+            std::uint8_t *to = (std::uint8_t *) memory.fieldAddressOf(array) + start - 1;
+            const std::uint8_t *from = (const std::uint8_t *) memory.fieldAddressOf(replacement) + repStart - 1;
+            
+            for(int i = 0; i < count; i++)
+                to[i] = from[i];
+#ifdef DELTA_SNAPSHOTS
+            memory.markDirty(to, count);
+#endif
+        }
+    }
+    pop(4); // answer the receiver
 }
 
 // lookupMethodInDictionary:
@@ -1467,11 +1703,70 @@ void Interpreter::returnToActiveContext(int aContext)
     
     memory.increaseReferencesTo(aContext);
     nilContextFields();
+#ifdef CONTEXT_FRAME_STACK
+    // the reference held by the activeContext register is handed over to the frame stack
+    if (!pushFrame(activeContext))
+#endif
     memory.decreaseReferencesTo(activeContext);
     activeContext = aContext;
     fetchContextRegisters();
 }
 
+#ifdef CONTEXT_FRAME_STACK
+// pushFrame:
+bool Interpreter::pushFrame(int context)
+{
+    int length;
+    int large;
+    
+    // Anything that captured the context (thisContext, the home of a BlockContext,
+    // a suspended Process) holds a reference in addition to the activeContext register
+    if (memory.referenceCountOf(context) != 1)
+        return false;
+    if (memory.fetchClassOf(context) != ClassMethodContextPointer)
+        return false;
+    
+    length = memory.fetchWordLengthOf(context);
+    if (length == 12 + TempFrameStart)
+        large = 0;
+    else if (length == 32 + TempFrameStart)
+        large = 1;
+    else
+        return false;
+    
+    if (frameStackTop[large] == FrameStackDepth)
+        return false;
+    
+    // Sender and instruction pointer have been cleared by nilContextFields.
+    // Release the rest so the context looks freshly instantiated when reused.
+    for(int i = StackPointerIndex; i < length; i++)
+    {
+        if (memory.fetchPointer_ofObject(i, context) != NilPointer)
+            memory.storePointer_ofObject_withValue(i, context, NilPointer);
+    }
+    frameStack[large][frameStackTop[large]++] = context;
+    return true;
+}
+
+// popFrame:
+int Interpreter::popFrame(int largeContextFlag)
+{
+    if (frameStackTop[largeContextFlag] == 0)
+        return NilPointer;
+    return frameStack[largeContextFlag][--frameStackTop[largeContextFlag]];
+}
+
+// releaseFrames
+void Interpreter::releaseFrames()
+{
+    for(int large = 0; large < 2; large++)
+    {
+        while (frameStackTop[large] > 0)
+            memory.decreaseReferencesTo(frameStack[large][--frameStackTop[large]]);
+    }
+}
+#endif
+
 
 // returnValue:to:
 void Interpreter::returnValue_to(int resultPointer, int contextPointer)
@@ -1551,6 +1846,28 @@ void Interpreter::synchronousSignal(int aSemaphore)
 }
 
 
+// synchronousSignal:count:
+void Interpreter::synchronousSignal_count(int aSemaphore, int count)
+{
+    int excessSignals;
+    
+    // Wake up to count waiting processes, the remaining signals become
+    // excess signals in a single store
+    while (count > 0 && !isEmptyList(aSemaphore))
+    {
+        int aProcess = removeFirstLinkOfList(aSemaphore);
+        resume(aProcess);
+        memory.decreaseReferencesTo(aProcess);
+        count--;
+    }
+    if (count > 0)
+    {
+        excessSignals = fetchInteger_ofObject(ExcessSignalsIndex, aSemaphore);
+        storeInteger_ofObject_withValue(ExcessSignalsIndex, aSemaphore, excessSignals + count);
+    }
+}
+
+
 // primitiveBlockCopy
 void Interpreter::primitiveBlockCopy()
 {
@@ -2115,11 +2432,12 @@ void Interpreter::checkProcessSwitch()
     }
     
     
-    while (semaphoreIndex >= 0)
-    {
-        synchronousSignal(semaphoreList[semaphoreIndex]);
-        semaphoreIndex = semaphoreIndex - 1;
-    }
+#ifdef GC_DEFERRED_REF_COUNT
+    if (memory.zeroCountTableNeedsReconcile())
+        memory.reconcileZeroCountTable();
+#endif
+    
+    signalPendingSemaphores();
     if (newProcessWaiting)
     {
         newProcessWaiting = false;
@@ -2252,12 +2570,67 @@ void Interpreter::asynchronousSignal(int aSemaphore)
    	semaphoreIndex <- semaphoreIndex + 1.
    	semaphoreList at: semaphoreIndex put: aSemaphore
    */
-    semaphoreIndex = semaphoreIndex + 1;
-    if (semaphoreIndex == sizeof(semaphoreList)/sizeof(semaphoreList[0])) {
-        CLogger::Get ()->Write ("interpreter", LogDebug, "overflow semaphore list");
-        // error("overflow semaphore list");
+    std::uint32_t head = semaphoreListHead.load(std::memory_order_relaxed);
+    
+    do {
+        if (head - semaphoreListTail.load(std::memory_order_acquire) == SemaphoreListSize) {
+            CLogger::Get ()->Write ("interpreter", LogDebug, "overflow semaphore list");
+            // error("overflow semaphore list");
+            return;
+        }
+    } while (!semaphoreListHead.compare_exchange_weak(head, head + 1, std::memory_order_relaxed));
+    semaphoreList[head & (SemaphoreListSize - 1)].store(aSemaphore, std::memory_order_release);
+}
+
+
+// signalPendingSemaphores
+void Interpreter::signalPendingSemaphores()
+{
+    // The Blue Book signals the buffered Semaphores one at a time, last one
+    // first. Here the signals are counted per Semaphore (in the order of the
+    // first signal) so that a burst of input costs one synchronousSignal:count:
+    // per Semaphore rather than one synchronousSignal: per entry.
+    const int MaxSemaphores = 8;
+    int semaphores[MaxSemaphores];
+    int counts[MaxSemaphores];
+    int distinct = 0;
+    std::uint32_t head = semaphoreListHead.load(std::memory_order_acquire);
+    std::uint32_t tail = semaphoreListTail.load(std::memory_order_relaxed);
+    
+    if (head == tail)
+        return;
+    
+    while (tail != head)
+    {
+        std::atomic<int> &slot = semaphoreList[tail & (SemaphoreListSize - 1)];
+        int aSemaphore = slot.load(std::memory_order_acquire);
+        int i = 0;
+        
+        if (aSemaphore == 0)
+            break; // reserved, not written yet
+        slot.store(0, std::memory_order_relaxed);
+        tail++;
+        while (i < distinct && semaphores[i] != aSemaphore)
+            i++;
+        if (i == distinct)
+        {
+            if (distinct == MaxSemaphores)
+            {
+                for(i = 0; i < distinct; i++)
+                    synchronousSignal_count(semaphores[i], counts[i]);
+                distinct = i = 0;
+            }
+            semaphores[i] = aSemaphore;
+            counts[i] = 0;
+            distinct++;
+        }
+        counts[i]++;
     }
-    semaphoreList[semaphoreIndex] = aSemaphore;
+    // The entries have been copied, the producer may reuse them
+    semaphoreListTail.store(tail, std::memory_order_release);
+    
+    for(int i = 0; i < distinct; i++)
+        synchronousSignal_count(semaphores[i], counts[i]);
 }
 
 
@@ -2359,6 +2732,7 @@ void Interpreter::primitiveCoreLeft()
 void Interpreter::primitiveQuit()
 {
     hal->signal_quit();
+    sliceInterrupted = true;
 
 }
 
@@ -2509,6 +2883,33 @@ void Interpreter::dispatchPrivatePrimitives()
         case 133: // Posix error string
             primitivePosixErrorStringOperation();
             break;
+        case 134: // Lookup cache statistics
+            primitiveSendCacheStatistics();
+            break;
+#ifdef CONTEXT_FREE_LISTS
+        case 135: // Context allocation statistics
+            primitiveContextStatistics();
+            break;
+#endif
+#ifdef HEAP_PROFILING
+        case 136: // Heap profile
+            primitiveHeapProfile();
+            break;
+#endif
+        case 137: // Bulk become
+            primitiveBulkBecome();
+            break;
+        case 138: // All instances
+            primitiveAllInstances();
+            break;
+        case 139: // Pointers to
+            primitivePointersTo();
+            break;
+#ifdef DELTA_SNAPSHOTS
+        case 140: // Delta snapshot
+            primitiveDeltaSnapshot();
+            break;
+#endif
         default:
             primitiveFail();
             break;
@@ -2541,6 +2942,115 @@ void Interpreter::primitivePosixErrorStringOperation()
         unPop(2);
 }
 
+void Interpreter::primitiveSendCacheStatistics()
+{
+    // Answer an Array with the method cache hits and misses followed by
+    // the send site cache hits and misses
+    const std::uint32_t counters[] = {
+        methodCacheHits, methodCacheMisses, sendSiteHits, sendSiteMisses
+    };
+    const int count = sizeof(counters)/sizeof(counters[0]);
+    
+    pop(1); // pop receiver
+    // Keep the result on the stack while the elements are allocated
+    push(memory.instantiateClass_withPointers(ClassArrayPointer, count));
+    for(int i = 0; i < count; i++)
+    {
+        memory.storePointer_ofObject_withValue(i, stackTop(), positive32BitIntegerFor(counters[i]));
+    }
+}
+
+#ifdef CONTEXT_FREE_LISTS
+void Interpreter::primitiveContextStatistics()
+{
+    // Answer an Array with the number of contexts instantiated, how many of
+    // them were taken from the context free lists and how many were put there
+    const std::uint32_t counters[] = {
+        memory.contextsAllocated(), memory.contextsRecycled(), memory.contextsReleased()
+    };
+    const int count = sizeof(counters)/sizeof(counters[0]);
+    
+    pop(1); // pop receiver
+    push(memory.instantiateClass_withPointers(ClassArrayPointer, count));
+    for(int i = 0; i < count; i++)
+    {
+        memory.storePointer_ofObject_withValue(i, stackTop(), positive32BitIntegerFor(counters[i]));
+    }
+}
+#endif
+
+#ifdef HEAP_PROFILING
+void Interpreter::primitiveHeapProfile()
+{
+    // The argument selects the operation
+    //   0  answer an Array with the milliseconds since the counters were
+    //      reset followed by class, live instances, words, allocations,
+    //      frees by reference counting and frees by garbage collection
+    //      for every class
+    //   1  write the profile, largest classes first, to the log
+    //   2  reset the counters
+    std::vector<std::pair<int, ObjectMemory::ClassProfile>> profiles;
+    int operation = popInteger();
+    
+    if (!success() || operation < 0 || operation > 2)
+    {
+        unPop(1);
+        primitiveFail();
+        return;
+    }
+    
+    if (operation == 2)
+    {
+        memory.resetHeapProfile();
+        return; // answer the receiver
+    }
+    
+    // Taken in one go, the answer allocates
+    std::uint32_t milliseconds = memory.heapProfileMilliseconds();
+    memory.heapProfile([&profiles](int classPointer, const ObjectMemory::ClassProfile& profile) {
+        profiles.push_back(std::make_pair(classPointer, profile));
+    });
+    
+    if (operation == 1)
+    {
+        std::sort(profiles.begin(), profiles.end(), [](const std::pair<int, ObjectMemory::ClassProfile>& a,
+                                                       const std::pair<int, ObjectMemory::ClassProfile>& b) {
+            return a.second.words > b.second.words;
+        });
+        CLogger::Get ()->Write ("interpreter", LogNotice, "heap profile of %u classes over %u ms",
+                                (unsigned) profiles.size(), milliseconds);
+        for(const auto& entry : profiles)
+        {
+            const ObjectMemory::ClassProfile& profile = entry.second;
+            std::uint32_t rate = milliseconds ? (std::uint32_t) ((std::uint64_t) profile.allocations * 1000 / milliseconds) : 0;
+            CLogger::Get ()->Write ("interpreter", LogNotice, "%-28s %6u live %8u words %8u allocated (%u/s) %8u counted %8u collected",
+                                    className(entry.first).c_str(), profile.instances, profile.words,
+                                    profile.allocations, rate, profile.countFrees, profile.collectionFrees);
+        }
+        return; // answer the receiver
+    }
+    
+    const int fieldsPerClass = 6;
+    pop(1); // pop receiver
+    push(memory.instantiateClass_withPointers(ClassArrayPointer, 1 + fieldsPerClass * (int) profiles.size()));
+    memory.storePointer_ofObject_withValue(0, stackTop(), positive32BitIntegerFor(milliseconds));
+    for(int i = 0; i < (int) profiles.size(); i++)
+    {
+        const ObjectMemory::ClassProfile& profile = profiles[i].second;
+        const std::uint32_t counters[] = {
+            profile.instances, profile.words, profile.allocations, profile.countFrees, profile.collectionFrees
+        };
+        int index = 1 + i * fieldsPerClass;
+        
+        memory.storePointer_ofObject_withValue(index, stackTop(), profiles[i].first);
+        for(int j = 0; j < fieldsPerClass - 1; j++)
+        {
+            memory.storePointer_ofObject_withValue(index + 1 + j, stackTop(), positive32BitIntegerFor(counters[j]));
+        }
+    }
+}
+#endif
+
 void Interpreter::primitivePosixFileOperation()
 {
     // command id, name, page, file
@@ -3169,6 +3679,13 @@ void Interpreter::initializeMethodCache()
    */
     for(unsigned i = 0; i < sizeof(methodCache)/sizeof(methodCache[0]); i++)
         methodCache[i] = NilPointer;
+#ifdef SEND_SITE_CACHES
+    for(int i = 0; i < SendSiteCacheSize; i++)
+    {
+        sendSiteCache[i].method = NilPointer;
+        sendSiteCache[i].count = 0;
+    }
+#endif
 }
 
 
@@ -3245,73 +3762,438 @@ void Interpreter::dispatchArithmeticPrimitives()
 }
 
 
-// primitiveEqual
-void Interpreter::primitiveEqual()
+#ifdef IMPLEMENT_LARGEINTEGER_PRIMITIVES
+
+// Magnitudes are byte vectors, least significant byte first, and may carry
+// leading zero bytes until they are turned back into an object
+
+typedef std::vector<std::uint8_t> Magnitude;
+
+static int magnitudeLength(const Magnitude &a)
 {
-   int integerReceiver;
-   int integerArgument;
+    int length = (int) a.size();
+    while (length > 0 && a[length-1] == 0)
+        length--;
+    return length;
+}
 
-   /* "source"
-   	integerArgument <- self popInteger.
-   	integerReceiver <- self popInteger.
-   	self success
-   		ifTrue: [integerReceiver = integerArgument
-   				ifTrue: [self push: TruePointer]
-   				ifFalse: [self push: FalsePointer]]
-   		ifFalse: [self unPop: 2]
-   */
+static int compareMagnitudes(const Magnitude &a, const Magnitude &b)
+{
+    int lengthA = magnitudeLength(a);
+    int lengthB = magnitudeLength(b);
     
-    integerArgument = popInteger();
-    integerReceiver = popInteger();
-
-    if (success())
+    if (lengthA != lengthB)
+        return lengthA < lengthB ? -1 : 1;
+    for(int i = lengthA - 1; i >= 0; i--)
     {
-        if (integerReceiver == integerArgument)
-            push(TruePointer);
-        else
-            push(FalsePointer);
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
     }
-    else
+    return 0;
+}
+
+static Magnitude addMagnitudes(const Magnitude &a, const Magnitude &b)
+{
+    size_t length = std::max(a.size(), b.size());
+    Magnitude sum(length + 1);
+    int carry = 0;
+    
+    for(size_t i = 0; i < length; i++)
     {
-        unPop(2);
+        carry += (i < a.size() ? a[i] : 0) + (i < b.size() ? b[i] : 0);
+        sum[i] = carry & 0xff;
+        carry >>= 8;
     }
+    sum[length] = carry;
+    return sum;
 }
 
-
-// primitiveBitOr
-void Interpreter::primitiveBitOr()
+// a - b, a must not be smaller than b
+static Magnitude subtractMagnitudes(const Magnitude &a, const Magnitude &b)
 {
-   int integerReceiver;
-   int integerArgument;
-   int integerResult;
-
-   /* "source"
-   	integerArgument <- self popInteger.
-   	integerReceiver <- self popInteger.
-   	self success
-   		ifTrue: [integerResult <- integerReceiver bitOr: integerArgument].
-   	self success
-   		ifTrue: [self pushInteger: integerResult]
-   		ifFalse: [self unPop: 2]
-   */
-
-    integerArgument = popInteger();
-    integerReceiver = popInteger();
+    Magnitude difference(a.size());
+    int borrow = 0;
     
-    if (success())
+    for(size_t i = 0; i < a.size(); i++)
     {
-        integerResult = integerReceiver | integerArgument;
-        pushInteger(integerResult);
+        int digit = a[i] - (i < b.size() ? b[i] : 0) - borrow;
+        borrow = digit < 0;
+        difference[i] = digit & 0xff;
     }
-    else
-        unPop(2);
+    return difference;
 }
 
-
-// primitiveDivide
-// The primitive routine for division (associated with the selector/) is different than
-// the other three arithmetic primitives since it only produces a result if the division
-// is exact, otherwise the primitive fails.
+static Magnitude multiplyMagnitudes(const Magnitude &a, const Magnitude &b)
+{
+    Magnitude product(a.size() + b.size());
+    
+    for(size_t i = 0; i < a.size(); i++)
+    {
+        std::uint32_t carry = 0;
+        if (a[i] == 0)
+            continue;
+        for(size_t j = 0; j < b.size(); j++)
+        {
+            carry += product[i+j] + (std::uint32_t) a[i] * b[j];
+            product[i+j] = carry & 0xff;
+            carry >>= 8;
+        }
+        for(size_t k = i + b.size(); carry != 0; k++)
+        {
+            carry += product[k];
+            product[k] = carry & 0xff;
+            carry >>= 8;
+        }
+    }
+    return product;
+}
+
+// Truncated division by shift and subtract, the divisor must not be zero
+static void divideMagnitudes(const Magnitude &a, const Magnitude &b, Magnitude &quotient, Magnitude &remainder)
+{
+    quotient.assign(a.size(), 0);
+    remainder.assign(1, 0);
+    for(int bit = (int) a.size() * 8 - 1; bit >= 0; bit--)
+    {
+        // remainder <- remainder * 2 + next bit of a
+        int carry = (a[bit >> 3] >> (bit & 7)) & 1;
+        for(size_t i = 0; i < remainder.size(); i++)
+        {
+            int digit = (remainder[i] << 1) | carry;
+            remainder[i] = digit & 0xff;
+            carry = digit >> 8;
+        }
+        if (carry)
+            remainder.push_back(carry);
+        if (compareMagnitudes(remainder, b) >= 0)
+        {
+            remainder = subtractMagnitudes(remainder, b);
+            quotient[bit >> 3] |= 1 << (bit & 7);
+        }
+    }
+}
+
+Interpreter::LargeIntegerValue Interpreter::addLargeIntegers(const LargeIntegerValue &a, const LargeIntegerValue &b)
+{
+    LargeIntegerValue sum;
+    
+    if (a.negative == b.negative)
+    {
+        sum.negative = a.negative;
+        sum.digits = addMagnitudes(a.digits, b.digits);
+    }
+    else if (compareMagnitudes(a.digits, b.digits) >= 0)
+    {
+        sum.negative = a.negative;
+        sum.digits = subtractMagnitudes(a.digits, b.digits);
+    }
+    else
+    {
+        sum.negative = b.negative;
+        sum.digits = subtractMagnitudes(b.digits, a.digits);
+    }
+    return sum;
+}
+
+int Interpreter::compareLargeIntegers(const LargeIntegerValue &a, const LargeIntegerValue &b)
+{
+    bool negativeA = a.negative && magnitudeLength(a.digits) > 0;
+    bool negativeB = b.negative && magnitudeLength(b.digits) > 0;
+    
+    if (negativeA != negativeB)
+        return negativeA ? -1 : 1;
+    return negativeA ? compareMagnitudes(b.digits, a.digits) : compareMagnitudes(a.digits, b.digits);
+}
+
+
+bool Interpreter::largeIntegerValueOf(int integerPointer, LargeIntegerValue &value)
+{
+    int classPointer;
+    int length;
+    
+    if (memory.isIntegerObject(integerPointer))
+    {
+        int integerValue = memory.integerValueOf(integerPointer);
+        
+        value.negative = integerValue < 0;
+        integerValue = std::abs(integerValue);
+        value.digits.assign(2, 0);
+        value.digits[0] = lowByteOf(integerValue);
+        value.digits[1] = highByteOf(integerValue);
+        return true;
+    }
+    
+    classPointer = memory.fetchClassOf(integerPointer);
+    if (classPointer != ClassLargePositiveIntegerPointer && classPointer != ClassLargeNegativeIntegerPointer)
+        return false;
+    
+    value.negative = classPointer == ClassLargeNegativeIntegerPointer;
+    length = memory.fetchByteLengthOf(integerPointer);
+    value.digits.resize(length);
+    for(int i = 0; i < length; i++)
+        value.digits[i] = memory.fetchByte_ofObject(i, integerPointer);
+    return true;
+}
+
+
+int Interpreter::largeIntegerObjectFor(LargeIntegerValue &value)
+{
+    int length = magnitudeLength(value.digits);
+    int integerPointer;
+    
+    if (length <= 2)
+    {
+        int integerValue = length == 0 ? 0 : value.digits[0];
+        
+        if (length == 2)
+            integerValue += value.digits[1] << 8;
+        if (value.negative)
+            integerValue = -integerValue;
+        if (memory.isIntegerValue(integerValue))
+            return memory.integerObjectOf(integerValue);
+    }
+    
+    integerPointer = memory.instantiateClass_withBytes(
+        value.negative ? ClassLargeNegativeIntegerPointer : ClassLargePositiveIntegerPointer, length);
+    for(int i = 0; i < length; i++)
+        memory.storeByte_ofObject_withValue(i, integerPointer, value.digits[i]);
+    return integerPointer;
+}
+
+
+// dispatchLargeIntegerPrimitives
+void Interpreter::dispatchLargeIntegerPrimitives()
+{
+    // Primitives 21-37 are those of 1-17 for LargePositiveInteger receivers,
+    // with SmallInteger, LargePositiveInteger and LargeNegativeInteger
+    // arguments. The results are normalized as Integer>>truncated would.
+    // Anything not handled here fails into the digit methods of the image:
+    // @, bit operations on negative integers and inexact /
+    LargeIntegerValue receiverValue;
+    LargeIntegerValue argumentValue;
+    LargeIntegerValue resultValue;
+    Magnitude remainder;
+    int comparison;
+    int result;
+    
+    if (!largeIntegerValueOf(stackValue(1), receiverValue) ||
+        !largeIntegerValueOf(stackValue(0), argumentValue))
+    {
+        primitiveFail();
+        return;
+    }
+    
+    switch (primitiveIndex)
+    {
+        case 21: // +
+        case 22: // -
+            if (primitiveIndex == 22)
+                argumentValue.negative = !argumentValue.negative;
+            resultValue = addLargeIntegers(receiverValue, argumentValue);
+            break;
+        case 23: // <
+        case 24: // >
+        case 25: // <=
+        case 26: // >=
+        case 27: // =
+        case 28: // ~=
+            comparison = compareLargeIntegers(receiverValue, argumentValue);
+            switch (primitiveIndex)
+            {
+                case 23: result = comparison < 0; break;
+                case 24: result = comparison > 0; break;
+                case 25: result = comparison <= 0; break;
+                case 26: result = comparison >= 0; break;
+                case 27: result = comparison == 0; break;
+                default: result = comparison != 0; break;
+            }
+            pop(2);
+            push(result ? TruePointer : FalsePointer);
+            return;
+        case 29: // *
+            resultValue.negative = receiverValue.negative != argumentValue.negative;
+            resultValue.digits = multiplyMagnitudes(receiverValue.digits, argumentValue.digits);
+            break;
+        case 30: // /
+        case 31: // \\ (modulo)
+        case 32: // //
+        case 33: // quo:
+            if (magnitudeLength(argumentValue.digits) == 0)
+            {
+                primitiveFail();
+                return;
+            }
+            divideMagnitudes(receiverValue.digits, argumentValue.digits, resultValue.digits, remainder);
+            resultValue.negative = receiverValue.negative != argumentValue.negative;
+            if (magnitudeLength(remainder) != 0)
+            {
+                if (primitiveIndex == 30)
+                {
+                    primitiveFail(); // answers a Fraction
+                    return;
+                }
+                if (resultValue.negative && primitiveIndex == 32)
+                {
+                    // round towards negative infinity
+                    Magnitude one(1, 1);
+                    resultValue.digits = addMagnitudes(resultValue.digits, one);
+                }
+                if (resultValue.negative && primitiveIndex == 31)
+                    remainder = subtractMagnitudes(argumentValue.digits, remainder);
+            }
+            if (primitiveIndex == 31)
+            {
+                // The modulo has the sign of the argument
+                resultValue.negative = argumentValue.negative;
+                resultValue.digits = remainder;
+            }
+            break;
+        case 34: // bitAnd:
+        case 35: // bitOr:
+        case 36: // bitXor:
+        {
+            size_t length = std::max(receiverValue.digits.size(), argumentValue.digits.size());
+            
+            if (receiverValue.negative || argumentValue.negative)
+            {
+                primitiveFail();
+                return;
+            }
+            receiverValue.digits.resize(length);
+            argumentValue.digits.resize(length);
+            resultValue.negative = false;
+            resultValue.digits.resize(length);
+            for(size_t i = 0; i < length; i++)
+            {
+                int a = receiverValue.digits[i];
+                int b = argumentValue.digits[i];
+                resultValue.digits[i] = primitiveIndex == 34 ? a & b : primitiveIndex == 35 ? a | b : a ^ b;
+            }
+            break;
+        }
+        case 37: // bitShift:
+        {
+            int shift;
+            int byteShift;
+            int bitShift;
+            int length;
+            
+            if (receiverValue.negative || !memory.isIntegerObject(stackValue(0)))
+            {
+                primitiveFail();
+                return;
+            }
+            shift = memory.integerValueOf(stackValue(0));
+            length = magnitudeLength(receiverValue.digits);
+            resultValue.negative = false;
+            if (shift >= 0)
+            {
+                byteShift = shift >> 3;
+                bitShift = shift & 7;
+                resultValue.digits.assign(length + byteShift + 1, 0);
+                for(int i = 0; i < length; i++)
+                {
+                    int digit = receiverValue.digits[i] << bitShift;
+                    resultValue.digits[i + byteShift] |= digit & 0xff;
+                    resultValue.digits[i + byteShift + 1] |= digit >> 8;
+                }
+            }
+            else
+            {
+                byteShift = -shift >> 3;
+                bitShift = -shift & 7;
+                resultValue.digits.assign(std::max(length - byteShift, 0), 0);
+                for(int i = 0; i < (int) resultValue.digits.size(); i++)
+                {
+                    int digit = receiverValue.digits[i + byteShift];
+                    if (i + byteShift + 1 < length)
+                        digit |= receiverValue.digits[i + byteShift + 1] << 8;
+                    resultValue.digits[i] = (digit >> bitShift) & 0xff;
+                }
+            }
+            break;
+        }
+        default:
+            primitiveFail();
+            return;
+    }
+    
+    // Allocate before popping so receiver and argument stay referenced
+    result = largeIntegerObjectFor(resultValue);
+    pop(2);
+    push(result);
+}
+
+#endif
+
+
+// primitiveEqual
+void Interpreter::primitiveEqual()
+{
+   int integerReceiver;
+   int integerArgument;
+
+   /* "source"
+   	integerArgument <- self popInteger.
+   	integerReceiver <- self popInteger.
+   	self success
+   		ifTrue: [integerReceiver = integerArgument
+   				ifTrue: [self push: TruePointer]
+   				ifFalse: [self push: FalsePointer]]
+   		ifFalse: [self unPop: 2]
+   */
+    
+    integerArgument = popInteger();
+    integerReceiver = popInteger();
+
+    if (success())
+    {
+        if (integerReceiver == integerArgument)
+            push(TruePointer);
+        else
+            push(FalsePointer);
+    }
+    else
+    {
+        unPop(2);
+    }
+}
+
+
+// primitiveBitOr
+void Interpreter::primitiveBitOr()
+{
+   int integerReceiver;
+   int integerArgument;
+   int integerResult;
+
+   /* "source"
+   	integerArgument <- self popInteger.
+   	integerReceiver <- self popInteger.
+   	self success
+   		ifTrue: [integerResult <- integerReceiver bitOr: integerArgument].
+   	self success
+   		ifTrue: [self pushInteger: integerResult]
+   		ifFalse: [self unPop: 2]
+   */
+
+    integerArgument = popInteger();
+    integerReceiver = popInteger();
+    
+    if (success())
+    {
+        integerResult = integerReceiver | integerArgument;
+        pushInteger(integerResult);
+    }
+    else
+        unPop(2);
+}
+
+
+// primitiveDivide
+// The primitive routine for division (associated with the selector/) is different than
+// the other three arithmetic primitives since it only produces a result if the division
+// is exact, otherwise the primitive fails.
 void Interpreter::primitiveDivide()
 {
    int integerReceiver;
@@ -4131,7 +5013,8 @@ void Interpreter::primitiveDiv()
        if (integerReceiver % integerArgument != 0)
        {
            // Smalltalk truncates to negative infinity ( -7 // 2 == -4 not -3)
-           if (integerResult < 0)
+           // (test the operand signs, -1 // 2 truncates to 0 but is -1)
+           if ((integerReceiver < 0) != (integerArgument < 0))
                integerResult--;
        }
        success(memory.isIntegerValue(integerResult));
@@ -4188,7 +5071,9 @@ std::string Interpreter::classNameOfObject(int objectPointer)
 {
     return className(memory.fetchClassOf(objectPointer));
 }
+#endif
 
+#if defined(DEBUGGING_SUPPORT) || defined(HEAP_PROFILING)
 std::string Interpreter::className(int classPointer)
 {
     if (classPointer == ClassSmallInteger)
@@ -4265,8 +5150,6 @@ void Interpreter::sendSelector_argumentCount(int selector, int count)
 // findNewMethodInClass:
 void Interpreter::findNewMethodInClass(int cls)
 {
-   int hash;
-
    /* "source"
    	hash <- (((messageSelector bitAnd: class) bitAnd: 16rFF) bitShift: 2) + 1.
    	((methodCache at: hash) = messageSelector
@@ -4280,26 +5163,116 @@ void Interpreter::findNewMethodInClass(int cls)
    			methodCache at: hash + 3 put: primitiveIndex]
    */
    
-    // This is not a great hash function
-    // Bits of History, pg.244 has a discussion and a better one
-    // hash = ((messageSelector ^ cls) & 0xff) << 2;
+#ifdef SEND_SITE_CACHES
+    // Check the cache of the send site first. The selector is part of the key
+    // since a method oop (and so a site) may be reused after the method has been
+    // reclaimed. The entries are only valid as long as the global method cache
+    // is, and are flushed with it.
+    SendSiteCache *site;
+    int hash;
     
-    hash = (messageSelector & cls & 0xff) << 2; // removed +1 since C arrays are zero based
-    if (methodCache[hash] == messageSelector && methodCache[hash+1] == cls)
+    hash = ((method >> 1) ^ (instructionPointer * 31)) & (SendSiteCacheSize - 1);
+    site = &sendSiteCache[hash];
+    if (site->method == method && site->instructionPointer == instructionPointer
+        && site->selector == messageSelector)
     {
-        newMethod = methodCache[hash+2];
-        primitiveIndex = methodCache[hash+3];
+        for(int i = 0; i < site->count; i++)
+        {
+            if (site->classes[i] == cls)
+            {
+                newMethod = site->methods[i];
+                primitiveIndex = site->primitiveIndices[i];
+#ifdef QUICK_SEND_BYPASS
+                newMethodQuickKind = site->quickKinds[i];
+#endif
+                sendSiteHits++;
+                return;
+            }
+        }
     }
     else
     {
+        site->method = method;
+        site->instructionPointer = instructionPointer;
+        site->selector = messageSelector;
+        site->count = 0;
+    }
+    sendSiteMisses++;
+    
+    lookupMethodInCache(cls);
+#ifdef QUICK_SEND_BYPASS
+    newMethodQuickKind = quickKindOf(newMethod, primitiveIndex);
+#endif
+    
+    // A message that was not understood has been turned into a doesNotUnderstand:
+    // which must not be cached under the original selector
+    if (messageSelector == site->selector)
+    {
+        if (site->count == SendSiteCacheClasses)
+        {
+            // megamorphic, drop the oldest class
+            for(int i = 1; i < SendSiteCacheClasses; i++)
+            {
+                site->classes[i-1] = site->classes[i];
+                site->methods[i-1] = site->methods[i];
+                site->primitiveIndices[i-1] = site->primitiveIndices[i];
+#ifdef QUICK_SEND_BYPASS
+                site->quickKinds[i-1] = site->quickKinds[i];
+#endif
+            }
+            site->count--;
+        }
+        site->classes[site->count] = cls;
+        site->methods[site->count] = newMethod;
+        site->primitiveIndices[site->count] = primitiveIndex;
+#ifdef QUICK_SEND_BYPASS
+        site->quickKinds[site->count] = newMethodQuickKind;
+#endif
+        site->count++;
+    }
+#else
+    lookupMethodInCache(cls);
+#endif
+}
 
-        lookupMethodInClass(cls);
-        methodCache[hash] = messageSelector;
-        methodCache[hash+1] = cls;
-        methodCache[hash+2] = newMethod;
-        methodCache[hash+3] = primitiveIndex;
+
+// lookupMethodInCache:
+void Interpreter::lookupMethodInCache(int cls)
+{
+    int hash;
+    int *entry;
+    
+    // The bluebook hash ((messageSelector & cls & 0xff) << 2) maps many
+    // selector/class pairs to the same entry. XOR both oops (dropping the low
+    // bit, which is always zero) and look in both entries of the set.
+    // Bits of History, pg.244
+    hash = (((messageSelector ^ cls) >> 1) & 0x7f) << 3;
+    entry = &methodCache[hash];
+    if (entry[0] == messageSelector && entry[1] == cls)
+    {
+        newMethod = entry[2];
+        primitiveIndex = entry[3];
+        methodCacheHits++;
+        return;
+    }
+    if (entry[4] == messageSelector && entry[5] == cls)
+    {
+        newMethod = entry[6];
+        primitiveIndex = entry[7];
+        methodCacheHits++;
+        return;
     }
+    methodCacheMisses++;
+    
+    lookupMethodInClass(cls);
     
+    // Most recent entry goes first, the older one is moved to the second way
+    for(int i = 0; i < 4; i++)
+        entry[i+4] = entry[i];
+    entry[0] = messageSelector;
+    entry[1] = cls;
+    entry[2] = newMethod;
+    entry[3] = primitiveIndex;
 }
 
 
@@ -4339,6 +5312,11 @@ void Interpreter::activateNewMethod()
         contextSize = 32 + TempFrameStart;
     else
         contextSize = 12 + TempFrameStart;
+#ifdef CONTEXT_FRAME_STACK
+    newContext = popFrame(largeContextFlagOf(newMethod));
+    bool reused = newContext != NilPointer;
+    if (!reused)
+#endif
     newContext = memory.instantiateClass_withPointers(
                     ClassMethodContextPointer, contextSize);
     memory.storePointer_ofObject_withValue(SenderIndex,
@@ -4354,6 +5332,11 @@ void Interpreter::activateNewMethod()
                                                  newContext);
     pop(argumentCount + 1);
     newActiveContext(newContext);
+#ifdef CONTEXT_FRAME_STACK
+    // drop the reference the frame stack held
+    if (reused)
+        memory.decreaseReferencesTo(newContext);
+#endif
 }
 
 
@@ -4375,6 +5358,19 @@ void Interpreter::sendSpecialSelectorBytecode()
    				argumentCount: count]
    */
     
+#ifdef SMALLINTEGER_FAST_PATHS
+    int result;
+    
+    if (between_and(currentBytecode, 176, 191) &&
+        smallIntegerSelector(currentBytecode, stackValue(1), stackValue(0), result))
+    {
+        popStack();
+        popStack();
+        push(result);
+        return;
+    }
+#endif
+    
     if (!specialSelectorPrimitiveResponse())
     {
         selectorIndex = (currentBytecode - 176) * 2;
@@ -4451,10 +5447,36 @@ void Interpreter::sendSelectorToClass(int classPointer)
    	self executeNewMethod
    */
     findNewMethodInClass(classPointer);
+#ifdef QUICK_SEND_BYPASS
+    if (newMethodQuickKind != NotQuick && argumentCount == 0)
+    {
+        quickSend();
+        return;
+    }
+#endif
     executeNewMethod();
 }
 
 
+#ifdef QUICK_SEND_BYPASS
+// Same effect as quickReturnSelf and quickInstanceLoad through
+// primitiveResponse, but without initPrimitive and the success flag
+void Interpreter::quickSend()
+{
+    int thisReceiver;
+    
+    if (newMethodQuickKind == QuickSelf)
+        return; // self is on stack top
+    
+    // Replace the receiver by the field, storePointer: counts the field up
+    // before the receiver is counted down
+    thisReceiver = stackTop();
+    memory.storePointer_ofObject_withValue(stackPointer, activeContext,
+        memory.fetchPointer_ofObject(newMethodQuickKind, thisReceiver));
+}
+#endif
+
+
 // sendLiteralSelectorBytecode
 void Interpreter::sendLiteralSelectorBytecode()
 {
@@ -4603,10 +5625,324 @@ void Interpreter::cycle()
     
     checkProcessSwitch();
     currentBytecode = fetchByte();
-    dispatchOnThisBytecode();
+    dispatchBytecode();
+#ifdef BYTECODE_BENCHMARK
+    if ((++bytecodesExecuted & 0xffff) == 0)
+        reportBytecodeRate();
+#endif
 }
 
 
+// runSlice:
+int Interpreter::runSlice(int budget)
+{
+    // Equivalent to calling cycle budget times, but the instruction pointer,
+    // stack pointer and the method, context and home context fields are kept
+    // in local pointers into object memory, so the stack, jump and push
+    // bytecodes (and SmallInteger arithmetic with SMALLINTEGER_FAST_PATHS)
+    // run without going through the object table. Everything else
+    // is handed to the regular bytecode routines with the registers written
+    // back first. Process switches are checked on entry, after sends and on
+    // backward jumps rather than before every bytecode.
+    //
+    // The pointers are only valid until the next allocation (which may compact
+    // the heap), so they are reloaded after every bytecode that takes the slow
+    // path. None of the bytecodes handled inline allocate.
+    
+    std::uint16_t *methodFields = 0;
+    const std::uint8_t *methodBytes = 0;
+    std::uint16_t *contextFields = 0;
+    std::uint16_t *homeFields = 0;
+    const std::uint8_t *ip = 0;
+    std::uint16_t *sp = 0;
+    int executed = 0;
+    
+    auto loadRegisters = [&]()
+    {
+        methodFields = memory.fieldAddressOf(method);
+        methodBytes = (const std::uint8_t *) methodFields;
+        contextFields = memory.fieldAddressOf(activeContext);
+        homeFields = homeContext == activeContext ? contextFields : memory.fieldAddressOf(homeContext);
+        ip = methodBytes + instructionPointer;
+        sp = contextFields + stackPointer;
+    };
+    
+    auto storeRegisters = [&]()
+    {
+        instructionPointer = (int) (ip - methodBytes);
+        stackPointer = (int) (sp - contextFields);
+    };
+    
+    // push: without the object table lookups
+    auto pushFast = [&](int object)
+    {
+#ifdef GC_DEFERRED_REF_COUNT
+        // stack fields are not counted
+        *++sp = object;
+#else
+        memory.increaseReferencesTo(object);
+        sp++;
+        memory.decreaseReferencesTo(*sp);
+        *sp = object;
+#endif
+    };
+    
+    // jumpIf:by: falls back to the slow path to send mustBeBoolean
+    auto booleanOnTop = [&]()
+    {
+        return *sp == TruePointer || *sp == FalsePointer;
+    };
+    
+    sliceInterrupted = false;
+    checkProcessSwitch();
+    loadRegisters();
+    
+    while (executed < budget && !sliceInterrupted)
+    {
+        int byte = *ip++;
+        int offset;
+#ifdef SMALLINTEGER_FAST_PATHS
+        int result;
+#endif
+        executed++;
+        
+        switch (byte >> 3)
+        {
+            case 0: case 1: // 0-15 pushReceiverVariableBytecode
+                pushFast(memory.fetchPointer_ofObject(byte & 15, receiver));
+                continue;
+            case 2: case 3: // 16-31 pushTemporaryVariableBytecode
+                pushFast(homeFields[(byte & 15) + TempFrameStart]);
+                continue;
+            case 4: case 5: case 6: case 7: // 32-63 pushLiteralConstantBytecode
+                pushFast(methodFields[(byte & 31) + LiteralStart]);
+                continue;
+            case 8: case 9: case 10: case 11: // 64-95 pushLiteralVariableBytecode
+                pushFast(memory.fetchPointer_ofObject(ValueIndex, methodFields[(byte & 31) + LiteralStart]));
+                continue;
+            case 12: // 96-103 storeAndPopReceiverVariableBytecode
+                memory.storePointer_ofObject_withValue(byte & 7, receiver, *sp--);
+                continue;
+            case 13: // 104-111 storeAndPopTemporaryVariableBytecode
+                memory.storePointer_ofObject_withValue((byte & 7) + TempFrameStart, homeContext, *sp--);
+                continue;
+            case 14: // 112-119 pushReceiverBytecode, pushConstantBytecode
+                switch (byte)
+                {
+                    case 112: pushFast(receiver); break;
+                    case 113: pushFast(TruePointer); break;
+                    case 114: pushFast(FalsePointer); break;
+                    case 115: pushFast(NilPointer); break;
+                    case 116: pushFast(MinusOnePointer); break;
+                    case 117: pushFast(ZeroPointer); break;
+                    case 118: pushFast(OnePointer); break;
+                    case 119: pushFast(TwoPointer); break;
+                }
+                continue;
+            case 16: // 135 popStackBytecode
+                if (byte == 135)
+                {
+                    sp--;
+                    continue;
+                }
+                break;
+            case 17: // 136 duplicateTopBytecode
+                if (byte == 136)
+                {
+                    pushFast(*sp);
+                    continue;
+                }
+                break;
+            case 18: // 144-151 shortUnconditionalJump
+                ip += (byte & 7) + 1;
+                continue;
+            case 19: // 152-159 shortConditionalJump
+                if (booleanOnTop())
+                {
+                    if (*sp-- == FalsePointer)
+                        ip += (byte & 7) + 1;
+                    continue;
+                }
+                break;
+            case 20: // 160-167 longUnconditionalJump
+                offset = ((byte & 7) - 4) * 256 + *ip++;
+                ip += offset;
+                if (offset < 0)
+                {
+                    storeRegisters();
+                    checkProcessSwitch();
+                    loadRegisters();
+                }
+                continue;
+            case 21: // 168-175 longConditionalJump
+                if (booleanOnTop())
+                {
+                    offset = (byte & 3) * 256 + *ip++;
+                    if (*sp-- == (byte < 172 ? TruePointer : FalsePointer))
+                        ip += offset;
+                    continue;
+                }
+                break;
+#ifdef SMALLINTEGER_FAST_PATHS
+            case 22: case 23: // 176-191 arithmetic special selectors
+                if (smallIntegerSelector(byte, sp[-1], sp[0], result))
+                {
+                    sp -= 2;
+                    if (result == TruePointer || result == FalsePointer)
+                    {
+                        // Fuse with a following jumpIfFalse/jumpIfTrue
+                        int next = *ip;
+                        if (between_and(next, 152, 159))
+                        {
+                            ip++;
+                            executed++;
+                            if (result == FalsePointer)
+                                ip += (next & 7) + 1;
+                            continue;
+                        }
+                        if (between_and(next, 168, 175))
+                        {
+                            offset = (next & 3) * 256 + ip[1];
+                            ip += 2;
+                            executed++;
+                            if (result == (next < 172 ? TruePointer : FalsePointer))
+                                ip += offset;
+                            continue;
+                        }
+                    }
+                    // The slots held SmallIntegers, no counts to drop
+                    *++sp = result;
+#ifndef GC_DEFERRED_REF_COUNT
+                    memory.increaseReferencesTo(result);
+#endif
+                    continue;
+                }
+                break;
+#endif
+        }
+        
+        // Everything else (sends, returns, extended stores, thisContext) runs
+        // through the regular routines
+        storeRegisters();
+        currentBytecode = byte;
+        dispatchBytecode();
+        if (between_and(byte, 131, 134) || byte >= 176)
+            checkProcessSwitch();
+        loadRegisters();
+    }
+    
+    storeRegisters();
+    
+#ifdef BYTECODE_BENCHMARK
+    std::uint32_t before = bytecodesExecuted;
+    bytecodesExecuted += executed;
+    if ((before >> 16) != (bytecodesExecuted >> 16))
+        reportBytecodeRate();
+#endif
+    
+    return executed;
+}
+
+
+#ifdef THREADED_DISPATCH
+// initializeBytecodeTable
+void Interpreter::initializeBytecodeTable()
+{
+    // Same decoding as dispatchOnThisBytecode, stackBytecode, jumpBytecode,
+    // sendBytecode and extendedSendBytecode, but done once up front so that
+    // cycle goes straight from the bytecode to the routine that executes it
+    for(int i = 0; i < 256; i++)
+    {
+        BytecodeHandler handler;
+        
+        if      (between_and(i, 0, 15))    handler = &Interpreter::pushReceiverVariableBytecode;
+        else if (between_and(i, 16, 31))   handler = &Interpreter::pushTemporaryVariableBytecode;
+        else if (between_and(i, 32, 63))   handler = &Interpreter::pushLiteralConstantBytecode;
+        else if (between_and(i, 64, 95))   handler = &Interpreter::pushLiteralVariableBytecode;
+        else if (between_and(i, 96, 103))  handler = &Interpreter::storeAndPopReceiverVariableBytecode;
+        else if (between_and(i, 104, 111)) handler = &Interpreter::storeAndPopTemporaryVariableBytecode;
+        else if (i == 112)                 handler = &Interpreter::pushReceiverBytecode;
+        else if (between_and(i, 113, 119)) handler = &Interpreter::pushConstantBytecode;
+        else if (between_and(i, 120, 127)) handler = &Interpreter::returnBytecode;
+        else if (i == 128)                 handler = &Interpreter::extendedPushBytecode;
+        else if (i == 129)                 handler = &Interpreter::extendedStoreBytecode;
+        else if (i == 130)                 handler = &Interpreter::extendedStoreAndPopBytecode;
+        else if (i == 131)                 handler = &Interpreter::singleExtendedSendBytecode;
+        else if (i == 132)                 handler = &Interpreter::doubleExtendedSendBytecode;
+        else if (i == 133)                 handler = &Interpreter::singleExtendedSuperBytecode;
+        else if (i == 134)                 handler = &Interpreter::doubleExtendedSuperBytecode;
+        else if (i == 135)                 handler = &Interpreter::popStackBytecode;
+        else if (i == 136)                 handler = &Interpreter::duplicateTopBytecode;
+        else if (i == 137)                 handler = &Interpreter::pushActiveContextBytecode;
+        else if (between_and(i, 144, 151)) handler = &Interpreter::shortUnconditionalJump;
+        else if (between_and(i, 152, 159)) handler = &Interpreter::shortConditionalJump;
+        else if (between_and(i, 160, 167)) handler = &Interpreter::longUnconditionalJump;
+        else if (between_and(i, 168, 175)) handler = &Interpreter::longConditionalJump;
+        else if (between_and(i, 176, 207)) handler = &Interpreter::sendSpecialSelectorBytecode;
+        else if (between_and(i, 208, 255)) handler = &Interpreter::sendLiteralSelectorBytecode;
+        else                               handler = &Interpreter::unusedBytecode;
+        
+        bytecodeTable[i] = handler;
+    }
+}
+#endif
+
+
+#ifdef BYTECODE_BENCHMARK
+// reportBytecodeRate
+void Interpreter::reportBytecodeRate()
+{
+    std::uint32_t now = hal->get_msclock();
+    std::uint32_t elapsed = now - benchmarkStartTime;
+    
+    if (elapsed < 5000)
+        return;
+    
+    std::uint64_t count = bytecodesExecuted - benchmarkStartCount;
+    std::uint32_t rate = (std::uint32_t) (count * 1000 / elapsed);
+    
+#ifdef THREADED_DISPATCH
+    const char *engine = "threaded";
+#else
+    const char *engine = "blue book";
+#endif
+    CLogger::Get ()->Write ("interpreter", LogNotice, "%u bytecodes/s (%s dispatch)", rate, engine);
+#ifdef GC_DEFERRED_REF_COUNT
+    CLogger::Get ()->Write ("interpreter", LogNotice, "%u stores deferred, %u counted, %u reconciles (%u ms), %u objects freed",
+                            memory.storesDeferred(), memory.storesCounted(), memory.reconciles(),
+                            memory.reconcileMilliseconds(), memory.objectsFreedByReconcile());
+#endif
+    
+    benchmarkStartCount = bytecodesExecuted;
+    benchmarkStartTime = now;
+}
+
+
+// benchmarkContextStores
+void Interpreter::benchmarkContextStores()
+{
+    // Not a sticky count like nil, true and false
+    int object = memory.fetchClassOf(activeContext);
+    std::uint32_t startTime = hal->get_msclock();
+    
+    for (int i = 0; i < 1000000; i++)
+    {
+        push(object);
+        popStack();
+    }
+    
+#ifdef GC_DEFERRED_REF_COUNT
+    const char *mode = "deferred";
+#else
+    const char *mode = "counted";
+#endif
+    // a million stores, so milliseconds are nanoseconds per store
+    CLogger::Get ()->Write ("interpreter", LogNotice, "%u ns per context store (%s)",
+                            hal->get_msclock() - startTime, mode);
+}
+#endif
+
+
 
 // interpret
 void Interpreter::interpret()
@@ -5154,6 +6490,111 @@ void Interpreter::primitiveSomeInstance()
 }
 
 
+bool Interpreter::objectsOfArgument(int argument, std::vector<int>& objects)
+{
+    // A single object or an Array of them, none a SmallInteger
+    if (memory.fetchClassOf(argument) == ClassArrayPointer)
+    {
+        int length = memory.fetchWordLengthOf(argument);
+        for(int i = 0; i < length; i++)
+        {
+            objects.push_back(memory.fetchPointer_ofObject(i, argument));
+        }
+    }
+    else
+        objects.push_back(argument);
+    
+    for(int objectPointer : objects)
+    {
+        if (memory.isIntegerObject(objectPointer))
+            return false;
+    }
+    return true;
+}
+
+
+void Interpreter::pushArrayOfObjects(const std::function <int (const std::function <void (int)>&)>& enumerate,
+                                     int excluded)
+{
+    for(;;)
+    {
+        int excludedCount = 0;
+        int count = enumerate([&excludedCount, excluded](int objectPointer) {
+            if (objectPointer == excluded)
+                excludedCount++;
+        });
+        count -= excludedCount;
+        push(memory.instantiateClass_withPointers(ClassArrayPointer, count));
+        
+        int result = stackTop();
+        int index = 0;
+        enumerate([&](int objectPointer) {
+            if (objectPointer == result || objectPointer == excluded)
+                return;
+            if (index < count)
+                memory.storePointer_ofObject_withValue(index, result, objectPointer);
+            index++;
+        });
+        
+        // Allocating the Array may have collected garbage; count again,
+        // without this Array (pop: leaves it in the stack slot)
+        if (index == count)
+            break;
+        popStack();
+        push(NilPointer);
+        pop(1);
+    }
+}
+
+
+void Interpreter::primitiveAllInstances()
+{
+    // The argument is a class, an Array of classes or nil for all objects.
+    // Answer an Array with their instances, from one pass over the object
+    // table instead of someInstance and nextInstance for each of them.
+    std::vector<int> classes;
+    int argument = popStack();
+    
+    if (argument != NilPointer)
+        success(objectsOfArgument(argument, classes));
+    if (!success())
+    {
+        unPop(1);
+        return;
+    }
+    
+    pop(1); // pop receiver
+    // Only nil means all objects, an empty Array of classes has no instances
+    bool allObjects = argument == NilPointer;
+    pushArrayOfObjects([this, &classes, allObjects](const std::function <void (int)>& action) {
+        return memory.forAllInstancesOf_count_do(classes.data(), (int) classes.size(), allObjects, action);
+    }, NilPointer);
+}
+
+
+void Interpreter::primitivePointersTo()
+{
+    // The argument is an object or an Array of objects. Answer an Array
+    // with the objects referring to any of them, the argument excluded.
+    std::vector<int> targets;
+    int argument = popStack();
+    
+    success(objectsOfArgument(argument, targets));
+    if (!success())
+    {
+        unPop(1);
+        return;
+    }
+    
+    pop(1); // pop receiver
+    // The stack pointer bounds the fields looked at in the active context
+    storeContextRegisters();
+    pushArrayOfObjects([this, &targets](const std::function <void (int)>& action) {
+        return memory.forAllObjectsReferringTo_count_do(targets.data(), (int) targets.size(), action);
+    }, argument);
+}
+
+
 // primitiveObjectAt
 void Interpreter::primitiveObjectAt()
 {
@@ -5471,6 +6912,25 @@ void Interpreter::primitiveBecome()
 }
 
 
+void Interpreter::primitiveBulkBecome()
+{
+    int otherArray;
+    int thisArray;
+    
+    // Like primitiveBecome for every pair of elements, in one primitive
+    otherArray = popStack();
+    thisArray = popStack();
+    success(memory.fetchClassOf(otherArray) == ClassArrayPointer);
+    success(memory.fetchClassOf(thisArray) == ClassArrayPointer);
+    if (success())
+        success(memory.swapPointersOfElementsOf_and(thisArray, otherArray));
+    if (success())
+        push(thisArray);
+    else
+        unPop(2);
+}
+
+
 // dispatchStorageManagementPrimitives
 void Interpreter::dispatchStorageManagementPrimitives()
 {
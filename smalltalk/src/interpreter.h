@@ -27,6 +27,8 @@
 
 #pragma once
 #include <string>
+#include <vector>
+#include <atomic>
 #include "objmemory.h"
 #include "filesystem.h"
 #include "hal.h"
@@ -54,6 +56,46 @@
 // implement optional primitiveScanCharacters
 #define IMPLEMENT_PRIMITIVE_SCANCHARS
 
+// implement optional LargePositiveInteger primitives (21-37)
+#define IMPLEMENT_LARGEINTEGER_PRIMITIVES
+
+// Dispatch each bytecode through a 256 entry handler table built at init
+// time instead of the range tests in dispatchOnThisBytecode
+#define THREADED_DISPATCH
+
+// Remember method lookups per send site (method and bytecode offset) in
+// front of the global method cache
+#define SEND_SITE_CACHES
+
+// Do SmallInteger arithmetic and comparisons of the special selector
+// bytecodes in place, and let a comparison feed a directly following
+// conditional jump without pushing a Boolean
+#define SMALLINTEGER_FAST_PATHS
+
+// Keep MethodContexts that return without having been captured (by
+// thisContext, a BlockContext or a suspended Process) on a frame stack and
+// reuse them for the next activation of the same size instead of freeing and
+// allocating a new context on every send. Captured contexts remain ordinary
+// heap objects. Escape is detected through the reference count.
+#define CONTEXT_FRAME_STACK
+
+#if !defined(GC_REF_COUNT) || defined(GC_DEFERRED_REF_COUNT)
+#undef CONTEXT_FRAME_STACK
+#endif
+
+// Remember with each send site cache entry whether the method is a quick
+// method (^self or answering an instance variable) and answer those sends
+// directly, without primitiveResponse and activateNewMethod
+#define QUICK_SEND_BYPASS
+
+#ifndef SEND_SITE_CACHES
+#undef QUICK_SEND_BYPASS
+#endif
+
+// Periodically log the bytecode execution rate. Build with and without
+// THREADED_DISPATCH to compare the two dispatch paths.
+//#define BYTECODE_BENCHMARK
+
 class Interpreter
 #ifdef GC_MARK_SWEEP
     : IGCNotification
@@ -68,12 +110,25 @@ public:
     // cycle
     void cycle();
     
+    // Execute up to budget bytecodes, returns the number executed
+    int runSlice(int budget);
+    
     inline void checkLowMemoryConditions()
     {
         checkLowMemory = true;
     }
     
+#ifdef GC_INCREMENTAL
+    // Between slices, pauses for at most maxMilliseconds
+    inline void collectGarbageIncrementally(std::uint32_t maxMilliseconds)
+    {
+        memory.incrementalCollectionStep(maxMilliseconds);
+    }
+#endif
+    
     // asynchronousSignal:
+    // May be called from device or interrupt code, but not from two of them
+    // at the same time (the semaphoreList is a single producer ring)
     void asynchronousSignal(int aSemaphore);
     
     
@@ -270,6 +325,15 @@ private:
         return memory.fetchPointer_ofObject(stackPointer - offset, activeContext);
     }
     
+    // Value of the SmallInteger at stackValue:, fails the primitive if there is none
+    inline int stackIntegerValue(int offset)
+    {
+        int integerPointer = stackValue(offset);
+        
+        success(memory.isIntegerObject(integerPointer));
+        return success() ? memory.integerValueOf(integerPointer) : 0;
+    }
+    
     // stackTop
     inline int stackTop()
     {
@@ -340,6 +404,9 @@ private:
     
     void  primitiveCopyBits();
     void  primitiveSnapshot();
+#ifdef DELTA_SNAPSHOTS
+    void  primitiveDeltaSnapshot();
+#endif
     void  primitiveTimeWordsInto();
     void  primitiveTickWordsInto();
     void  primitiveSignalAtTick();
@@ -469,6 +536,12 @@ private:
     // synchronousSignal:
     void synchronousSignal(int aSemaphore);
     
+    // synchronousSignal: count times, with the excess signals added in one step
+    void synchronousSignal_count(int aSemaphore, int count);
+    
+    // Drain the semaphoreList, one synchronousSignal:count: per Semaphore
+    void signalPendingSemaphores();
+    
     // primitiveBlockCopy
     void primitiveBlockCopy();
     
@@ -574,6 +647,26 @@ private:
     void primitivePosixDirectoryOperation();
     void primitivePosixLastErrorOperation();
     void primitivePosixErrorStringOperation();
+    
+    // Method cache and send site cache hit/miss counters
+    void primitiveSendCacheStatistics();
+#ifdef CONTEXT_FREE_LISTS
+    // Context free list counters
+    void primitiveContextStatistics();
+#endif
+#ifdef HEAP_PROFILING
+    // Per class allocation counters and live instances
+    void primitiveHeapProfile();
+#endif
+    // become: for all elements of two Arrays
+    void primitiveBulkBecome();
+    // Instances of a class or Array of classes, or all objects
+    void primitiveAllInstances();
+    // Objects referring to an object or to one of an Array of objects
+    void primitivePointersTo();
+    bool objectsOfArgument(int argument, std::vector<int>& objects);
+    void pushArrayOfObjects(const std::function <int (const std::function <void (int)>&)>& enumerate,
+                            int excluded);
 
     
     // --- PrimitiveTest ---
@@ -662,6 +755,57 @@ private:
     // specialSelectorPrimitiveResponse
     int specialSelectorPrimitiveResponse();
     
+#ifdef SMALLINTEGER_FAST_PATHS
+    // Result of an arithmetic special selector (176-191) with SmallInteger
+    // receiver and argument, either a SmallInteger or a Boolean. False if the
+    // regular primitive has to run (other operands, overflow, zero divisor,
+    // / @ and bitShift:)
+    inline bool smallIntegerSelector(int bytecode, int receiverPointer, int argumentPointer, int &result)
+    {
+        int rcvr, arg, value;
+        
+        if ((receiverPointer & argumentPointer & 1) == 0)
+            return false;
+        
+        rcvr = memory.integerValueOf(receiverPointer);
+        arg = memory.integerValueOf(argumentPointer);
+        switch (bytecode)
+        {
+            case 176: value = rcvr + arg; break;
+            case 177: value = rcvr - arg; break;
+            case 178: result = rcvr < arg ? TruePointer : FalsePointer; return true;
+            case 179: result = rcvr > arg ? TruePointer : FalsePointer; return true;
+            case 180: result = rcvr <= arg ? TruePointer : FalsePointer; return true;
+            case 181: result = rcvr >= arg ? TruePointer : FalsePointer; return true;
+            case 182: result = rcvr == arg ? TruePointer : FalsePointer; return true;
+            case 183: result = rcvr != arg ? TruePointer : FalsePointer; return true;
+            case 184: value = rcvr * arg; break;
+            case 186: // \\ rounds towards negative infinity
+                if (arg == 0)
+                    return false;
+                value = rcvr % arg;
+                if (value != 0 && (value < 0) != (arg < 0))
+                    value += arg;
+                break;
+            case 189: // // rounds towards negative infinity
+                if (arg == 0)
+                    return false;
+                value = rcvr / arg;
+                if (rcvr % arg != 0 && (rcvr < 0) != (arg < 0))
+                    value--;
+                break;
+            case 190: value = rcvr & arg; break;
+            case 191: value = rcvr | arg; break;
+            default:
+                return false;
+        }
+        if (!memory.isIntegerValue(value))
+            return false;
+        result = memory.integerObjectOf(value);
+        return true;
+    }
+#endif
+    
     // commonSelectorPrimitive
     void commonSelectorPrimitive();
     
@@ -694,6 +838,29 @@ private:
     void primitiveMultiply();
     
     // dispatchLargeIntegerPrimitives
+#ifdef IMPLEMENT_LARGEINTEGER_PRIMITIVES
+    void dispatchLargeIntegerPrimitives();
+    
+    // Sign and magnitude of an integer, least significant byte first
+    struct LargeIntegerValue
+    {
+        bool negative;
+        std::vector<std::uint8_t> digits;
+    };
+    
+    // Value of a SmallInteger, LargePositiveInteger or LargeNegativeInteger,
+    // false for anything else
+    bool largeIntegerValueOf(int integerPointer, LargeIntegerValue &value);
+    
+    // Normalized integer object (a SmallInteger if in range)
+    int largeIntegerObjectFor(LargeIntegerValue &value);
+    
+    // Signed sum, a - b is a + b with b negated
+    static LargeIntegerValue addLargeIntegers(const LargeIntegerValue &a, const LargeIntegerValue &b);
+    
+    // -1, 0 or 1
+    static int compareLargeIntegers(const LargeIntegerValue &a, const LargeIntegerValue &b);
+#else
     inline void dispatchLargeIntegerPrimitives()
     {
        /* "source"
@@ -702,6 +869,7 @@ private:
     
         primitiveFail();
     }
+#endif
     
     // primitiveBitAnd
     void primitiveBitAnd();
@@ -779,6 +947,33 @@ private:
     // findNewMethodInClass:
     void findNewMethodInClass(int cls);
     
+    // Global method cache part of findNewMethodInClass:
+    void lookupMethodInCache(int cls);
+    
+#ifdef QUICK_SEND_BYPASS
+    // Quick kinds besides the field index of an instance variable load
+    static const int NotQuick = -1;
+    static const int QuickSelf = -2;
+    
+    // Kind of newMethod as primitiveResponse would run it
+    inline int quickKindOf(int methodPointer, int index)
+    {
+        int flagValue;
+        
+        if (index != 0)
+            return NotQuick;
+        flagValue = flagValueOf(methodPointer);
+        if (flagValue == 5)
+            return QuickSelf;
+        if (flagValue == 6)
+            return fieldIndexOf(methodPointer);
+        return NotQuick;
+    }
+    
+    // Answer a quick method in place of the receiver
+    void quickSend();
+#endif
+    
     // activateNewMethod
     void activateNewMethod();
     
@@ -812,6 +1007,22 @@ private:
     // executeNewMethod
     void executeNewMethod();
     
+#ifdef CONTEXT_FRAME_STACK
+    // Contexts per size (indexed by largeContextFlagOf) kept for reuse
+    static const int FrameStackDepth = 64;
+    int frameStack[2][FrameStackDepth];
+    int frameStackTop[2];
+    
+    // Keep a returning context for reuse, false if it has been captured
+    bool pushFrame(int context);
+    
+    // A cleared context of the given size or NilPointer
+    int popFrame(int largeContextFlag);
+    
+    // Let the object memory reclaim all kept contexts
+    void releaseFrames();
+#endif
+    
     
     // --- MainLoop ---
     
@@ -824,6 +1035,44 @@ private:
     // interpret
     void interpret();
     
+    // Execute currentBytecode with the engine selected at build time
+    inline void dispatchBytecode()
+    {
+#ifdef THREADED_DISPATCH
+        (this->*bytecodeTable[currentBytecode])();
+#else
+        dispatchOnThisBytecode();
+#endif
+    }
+    
+    // Set to end the current runSlice early (e.g. on quit)
+    bool sliceInterrupted;
+    
+#ifdef THREADED_DISPATCH
+    typedef void (Interpreter::*BytecodeHandler)();
+    
+    // Handler for each of the 256 bytecodes, indexed by currentBytecode
+    BytecodeHandler bytecodeTable[256];
+    
+    void initializeBytecodeTable();
+    
+    // 138-143 are unused
+    inline void unusedBytecode()
+    {
+    }
+#endif
+    
+#ifdef BYTECODE_BENCHMARK
+    std::uint32_t bytecodesExecuted;
+    std::uint32_t benchmarkStartCount;
+    std::uint32_t benchmarkStartTime;
+    
+    void reportBytecodeRate();
+    
+    // Log the cost of a push and pop on the active context
+    void benchmarkContextStores();
+#endif
+    
 private:
     // --- CompiledMethod ---
     
@@ -1425,14 +1674,59 @@ private:
      The semaphoreList register points to an Array used by the interpreter to buffer Semaphores that should be signaled. This is an Array in Interpreter, not in the object memory. It will be a table in a machine-language interpreter.
      */
     
-    int semaphoreList[4096];
+    static const int SemaphoreListSize = 4096; // must be a power of two
     
-    int semaphoreIndex; // The semaphoreIndex register hold the index of the last Semaphore in the semaphoreList buffer.
+    std::atomic<int> semaphoreList[SemaphoreListSize];
+    
+    // Instead of the semaphoreIndex register the semaphoreList is a ring:
+    // asynchronousSignal: writes at the head, checkProcessSwitch reads from
+    // the tail. There are several producers (the input interrupt handlers and
+    // the interpreter itself), so a slot is reserved by compare and swap of
+    // the head and published by storing the Semaphore into it. Empty slots
+    // hold 0, which is never an oop; the consumer stops at a slot reserved
+    // but not written yet.
+    std::atomic<std::uint32_t> semaphoreListHead;
+    std::atomic<std::uint32_t> semaphoreListTail;
     
     // Using an array of int for method cache to remain faithful as possible to the bluebook
     // Any size change will require changes to hash function in findNewMethodInClass
+    // The cache is two way set associative: 128 sets of two 4 word entries
     int methodCache[1024];
     
+#ifdef SEND_SITE_CACHES
+    // Polymorphic inline caches kept in a side table indexed by a hash of the
+    // method and the instruction pointer following the send bytecode
+    static const int SendSiteCacheSize = 1024; // must be a power of two
+    static const int SendSiteCacheClasses = 4; // receiver classes remembered per site
+    
+    struct SendSiteCache
+    {
+        int method;
+        int instructionPointer;
+        int selector;
+        int count;
+        int classes[SendSiteCacheClasses];
+        int methods[SendSiteCacheClasses];
+        int primitiveIndices[SendSiteCacheClasses];
+#ifdef QUICK_SEND_BYPASS
+        int quickKinds[SendSiteCacheClasses];
+#endif
+    };
+    
+    SendSiteCache sendSiteCache[SendSiteCacheSize];
+#endif
+    
+#ifdef QUICK_SEND_BYPASS
+    // Quick kind of newMethod, set by findNewMethodInClass:
+    int newMethodQuickKind;
+#endif
+    
+    // Lookup statistics
+    std::uint32_t methodCacheHits;
+    std::uint32_t methodCacheMisses;
+    std::uint32_t sendSiteHits;
+    std::uint32_t sendSiteMisses;
+    
     ObjectMemory memory;
     
     // dbanay - primitiveSignalAtOopsLeftWordsLeft support
@@ -1456,6 +1750,8 @@ private:
 #ifdef DEBUGGING_SUPPORT
     std::string selectorName(int selector);
     std::string classNameOfObject(int objectPointer);
+#endif
+#if defined(DEBUGGING_SUPPORT) || defined(HEAP_PROFILING)
     std::string className(int classPointer);
 #endif
     
@@ -29,11 +29,28 @@
 #include <cstdint>
 #include <cstring>
 #include <algorithm>
+#include <string>
+#include <vector>
 #include "objmemory.h"
 #include "oops.h"
 
 #include "snapshot.h"
 
+// A snapshot is written next to the image and renamed over it once it is
+// complete. The image it replaces is kept as a backup.
+static const char SnapshotTemporarySuffix[] = ".tmp";
+static const char SnapshotBackupSuffix[] = ".bak";
+
+#ifdef DELTA_SNAPSHOTS
+// A delta snapshot has the magic, the length and checksum of the base
+// snapshot file and a record for each object table entry that changed: the
+// oop, the first word of the entry as in the image (without the segment) and
+// the size of the object, followed by its class and fields, or 0 if only the
+// entry changed. It is written and compressed like a snapshot.
+static const char SnapshotDeltaSuffix[] = ".delta";
+static const std::uint8_t DeltaMagic[4] = { 'S', 'T', '8', 'D' };
+#endif
+
 #ifndef GC_REF_COUNT
 #ifndef GC_MARK_SWEEP
 #error "must define GC_REF_COUNT and/or GC_MARK_SWEEP"
@@ -47,6 +64,220 @@
 int bootmode = 0;
 long offset = 0;
 
+// Image loaded with bootmode 0 and 2: the embedded snapshot, or the file
+// read into a buffer of its size, freed once the objects are in the heap
+static const std::uint8_t *imageBytes = ___files_snapshot_im;
+static std::uint8_t *imageBuffer = 0;
+static int imageLength = 0;
+
+// Compressed snapshots start with the magic, followed by blocks of up to
+// SnapshotBufferSize bytes. Each block has its compressed and its original
+// length (32 bit), equal if the block is stored as is, and the data.
+//
+// Compressed data are sequences of a token byte, literal bytes, a 16 bit
+// offset back into the output and the length of a match copied from there,
+// as in LZ4. The high nibble of the token is the number of literals, the low
+// nibble the match length minus SnapshotMinimumMatch; 15 means more follows
+// in bytes of 255 and a final byte less than that. The last sequence of a
+// block has literals only.
+static const std::uint8_t SnapshotMagic[4] = { 'S', 'T', '8', 'Z' };
+static const int SnapshotMinimumMatch = 4;
+static const int SnapshotHashBits = 12;
+
+static bool isCompressedSnapshot(const std::uint8_t *bytes, int length)
+{
+    return length >= (int) sizeof(SnapshotMagic) && memcmp(bytes, SnapshotMagic, sizeof(SnapshotMagic)) == 0;
+}
+
+#ifdef COMPRESSED_SNAPSHOTS
+static inline std::uint32_t snapshotHash(const std::uint8_t *bytes)
+{
+    std::uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return (value * 2654435761u) >> (32 - SnapshotHashBits);
+}
+
+static inline bool putSnapshotLength(std::uint8_t *&output, std::uint8_t *limit, int length)
+{
+    for(; length >= 255; length -= 255)
+    {
+        if (output == limit)
+            return false;
+        *output++ = 255;
+    }
+    if (output == limit)
+        return false;
+    *output++ = length;
+    return true;
+}
+
+// Compress a block into fewer than length bytes, answer the compressed length
+// or -1 if it does not get smaller. Equal lengths mark a stored block.
+static int compressSnapshotBlock(const std::uint8_t *input, int length, std::uint8_t *output,
+                                 std::int32_t *positions)
+{
+    const std::uint8_t *anchor = input;
+    const std::uint8_t *current = input;
+    const std::uint8_t *end = input + length;
+    std::uint8_t *start = output;
+    std::uint8_t *limit = output + length - 1;
+
+    for(int i = 0; i < 1 << SnapshotHashBits; i++)
+        positions[i] = -1;
+
+    for(;;)
+    {
+        // Find the next match, or the end of the block
+        const std::uint8_t *match = 0;
+        while (current + SnapshotMinimumMatch <= end)
+        {
+            std::uint32_t hash = snapshotHash(current);
+            std::int32_t candidate = positions[hash];
+            positions[hash] = current - input;
+            if (candidate >= 0 && current - (input + candidate) <= 0xffff &&
+                memcmp(input + candidate, current, SnapshotMinimumMatch) == 0)
+            {
+                match = input + candidate;
+                break;
+            }
+            current++;
+        }
+
+        int literals = (match ? current : end) - anchor;
+        int matchLength = 0;
+        if (match)
+        {
+            matchLength = SnapshotMinimumMatch;
+            while (current + matchLength < end && match[matchLength] == current[matchLength])
+                matchLength++;
+        }
+
+        if (output == limit)
+            return -1;
+        std::uint8_t *token = output++;
+        *token = std::min(literals, 15) << 4;
+        if (literals >= 15 && !putSnapshotLength(output, limit, literals - 15))
+            return -1;
+        if (literals > limit - output)
+            return -1;
+        memcpy(output, anchor, literals);
+        output += literals;
+        if (!match)
+            return output - start;
+
+        std::uint16_t offset = current - match;
+        if (limit - output < (int) sizeof(offset))
+            return -1;
+        memcpy(output, &offset, sizeof(offset));
+        output += sizeof(offset);
+        *token |= std::min(matchLength - SnapshotMinimumMatch, 15);
+        if (matchLength - SnapshotMinimumMatch >= 15 &&
+            !putSnapshotLength(output, limit, matchLength - SnapshotMinimumMatch - 15))
+            return -1;
+
+        current += matchLength;
+        anchor = current;
+    }
+}
+
+#endif
+
+static inline bool getSnapshotLength(const std::uint8_t *&input, const std::uint8_t *end, int &length)
+{
+    std::uint8_t byte;
+    do
+    {
+        if (input == end)
+            return false;
+        byte = *input++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static bool decompressSnapshotBlock(const std::uint8_t *input, int compressedLength,
+                                    std::uint8_t *output, int length)
+{
+    const std::uint8_t *end = input + compressedLength;
+    std::uint8_t *start = output;
+    std::uint8_t *limit = output + length;
+
+    while (input < end)
+    {
+        std::uint8_t token = *input++;
+        int literals = token >> 4;
+        if (literals == 15 && !getSnapshotLength(input, end, literals))
+            return false;
+        if (literals > end - input || literals > limit - output)
+            return false;
+        memcpy(output, input, literals);
+        input += literals;
+        output += literals;
+        if (input == end)
+            break;
+
+        std::uint16_t offset;
+        if (end - input < (int) sizeof(offset))
+            return false;
+        memcpy(&offset, input, sizeof(offset));
+        input += sizeof(offset);
+        int matchLength = token & 15;
+        if (matchLength == 15 && !getSnapshotLength(input, end, matchLength))
+            return false;
+        matchLength += SnapshotMinimumMatch;
+        if (offset == 0 || offset > output - start || matchLength > limit - output)
+            return false;
+        // May overlap, byte by byte
+        const std::uint8_t *match = output - offset;
+        while (matchLength-- > 0)
+            *output++ = *match++;
+    }
+    return output == limit;
+}
+
+// The image of a compressed snapshot in a new buffer, or 0 if it is damaged.
+// No block is longer than blockSize.
+static std::uint8_t *decompressSnapshot(const std::uint8_t *bytes, int length, int blockSize,
+                                        int *decompressedLength)
+{
+    const std::uint8_t *end = bytes + length;
+    const std::uint8_t *input;
+    std::uint32_t lengths[2];   // compressed, original
+    int total = 0;
+
+    // First the size
+    for(input = bytes + sizeof(SnapshotMagic); end - input >= (int) sizeof(lengths); )
+    {
+        memcpy(lengths, input, sizeof(lengths));
+        if (lengths[0] > lengths[1] || lengths[1] > (std::uint32_t) blockSize ||
+            lengths[0] > (std::uint32_t) (end - input - sizeof(lengths)))
+            return 0;
+        input += sizeof(lengths) + lengths[0];
+        total += lengths[1];
+    }
+    if (input != end)
+        return 0;
+
+    std::uint8_t *image = new std::uint8_t[total];
+    std::uint8_t *output = image;
+    for(input = bytes + sizeof(SnapshotMagic); input < end; )
+    {
+        memcpy(lengths, input, sizeof(lengths));
+        input += sizeof(lengths);
+        if (lengths[0] == lengths[1])
+            memcpy(output, input, lengths[1]);
+        else if (!decompressSnapshotBlock(input, lengths[0], output, lengths[1]))
+        {
+            delete [] image;
+            return 0;
+        }
+        input += lengths[0];
+        output += lengths[1];
+    }
+    *decompressedLength = total;
+    return image;
+}
+
 ObjectMemory::ObjectMemory(
                            IHardwareAbstractionLayer *halInterface
 #ifdef GC_MARK_SWEEP
@@ -58,6 +289,47 @@ ObjectMemory::ObjectMemory(
     gcNotification = notification;
 #endif
     hal = halInterface;
+#ifdef NATIVE_OBJECT_TABLE
+    for (int i = 0; i < ObjectTableSize / 2; i++)
+    {
+        objectTable[i].address = wordMemory.segment_word_address(0, 0);
+        objectTable[i].count = 0;
+        objectTable[i].flags = FreeFlag;
+    }
+#endif
+#ifdef CONTEXT_FREE_LISTS
+    resetContextFreeLists();
+    contextAllocations = contextRecycles = contextReleases = 0;
+#endif
+#ifdef EXPLICIT_MARK_STACK
+    traversalStackCount = 0;
+    traversalOverflows = 0;
+#endif
+#ifdef HEAP_PROFILING
+    resetHeapProfile();
+#endif
+#ifdef DELTA_SNAPSHOTS
+    heapBase = wordMemory.segment_word_address(0, 0);
+    baseLength = 0;
+    baseChecksum = 0;
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+    memset(changedObjects, 0, sizeof(changedObjects));
+#endif
+#ifdef GC_INCREMENTAL
+    incrementalPhase = IncrementalIdle;
+    markStackCount = 0;
+    markStackOverflowed = false;
+    sweepPointer = 0;
+    oopsAfterLastCycle = wordsAfterLastCycle = 0;
+    incrementalCycleCount = incrementalFreed = 0;
+#endif
+#ifdef GC_DEFERRED_REF_COUNT
+    memset(zeroCountBits, 0, sizeof(zeroCountBits));
+    zeroCountTableCount = 0;
+    zeroCountTableOverflowed = false;
+    deferredStores = countedStores = 0;
+    reconcileCount = reconcileTime = reconcileFreed = 0;
+#endif
 }
 
 
@@ -70,8 +342,8 @@ bool ObjectMemory::loadObjectTable(IFileSystem *fileSystem, int fd)
     int fileSize = 0;
     switch (bootmode) {
         case 0: // load from memory image
-            memcpy((char *)&objectTableLength, &___files_snapshot_im[4], sizeof(objectTableLength));
-            fileSize = ___files_snapshot_im_len;
+            memcpy((char *)&objectTableLength, &imageBytes[4], sizeof(objectTableLength));
+            fileSize = imageLength;
             break;
         case 1: // load slow from SD
             if (fileSystem->seek_to(fd, 4) == -1) // Skip over object space length
@@ -81,9 +353,8 @@ bool ObjectMemory::loadObjectTable(IFileSystem *fileSystem, int fd)
             fileSize = fileSystem->file_size(fd);
             break;
         case 2: // load fast from SD
-            fileSize = fileSystem->file_size(fd);
-            ___files_snapshot_im_len = fileSize;
-            memcpy((char *)&objectTableLength, &___files_snapshot_im[4], sizeof(objectTableLength));
+            fileSize = imageLength;
+            memcpy((char *)&objectTableLength, &imageBytes[4], sizeof(objectTableLength));
             break;
         default:
             CLogger::Get ()->Write ("objmemory", LogDebug, "Unsupported bootmode %d", bootmode);
@@ -113,7 +384,7 @@ bool ObjectMemory::loadObjectTable(IFileSystem *fileSystem, int fd)
             if (fileSystem->read(fd, (char *)&words, sizeof(words)) != sizeof(words))
                 return false;
         } else {
-            memcpy((char *)&words, &___files_snapshot_im[offset], sizeof(words));
+            memcpy((char *)&words, &imageBytes[offset], sizeof(words));
             offset += sizeof(words);
         }
 
@@ -178,8 +449,7 @@ bool ObjectMemory::loadObjects(IFileSystem *fileSystem, int fd)
         if (bootmode == 1) { // #if LOAD_FROM_SD
             fileSystem->read(fd, (char *) &objectSize, sizeof(objectSize));
         } else {
-            memcpy((char *)&objectSize, &___files_snapshot_im[offset], sizeof(objectSize));
-            offset += sizeof(objectSize);
+            memcpy((char *)&objectSize, &imageBytes[offset], sizeof(objectSize));
         }
         
         // Account for the extra word used by HugeSize objects
@@ -198,34 +468,14 @@ bool ObjectMemory::loadObjects(IFileSystem *fileSystem, int fd)
         segmentBitsOf_put(objectPointer, destinationSegment);
         locationBitsOf_put(objectPointer, destinationWord);
         
-        // Store the object in the image into word memory
-        // First comes the size...
-        
-        sizeBitsOf_put(objectPointer, objectSize );
-        
-        // Next is the class...
-        std::uint16_t classBits;
+        // The size, class and fields are laid out in the heap as in the
+        // image, so the object is copied (or read) in one piece
+        std::uint16_t *chunk = fieldAddressOf(objectPointer) - HeaderSize;
         if (bootmode == 1) { // #if LOAD_FROM_SD
-            fileSystem->read(fd,(char *) &classBits, sizeof(classBits));
+            chunk[0] = objectSize;
+            fileSystem->read(fd, (char *) (chunk + 1), (objectSize - 1) * sizeof(std::uint16_t));
         } else {
-            memcpy((char *)&classBits, &___files_snapshot_im[offset], sizeof(classBits));
-            offset += sizeof(classBits);
-        }
-        
-        classBitsOf_put(objectPointer, classBits);
-        
-        // Followed by the fields...
-        for(int wordIndex = 0; wordIndex < objectSize-HeaderSize; wordIndex++)
-        {
-            std::uint16_t word;
-            if (bootmode == 1) { // #if LOAD_FROM_SD
-                fileSystem->read(fd,(char *) &word, sizeof(word));
-            } else {
-                memcpy((char *)&word, &___files_snapshot_im[offset], sizeof(word));
-                offset += sizeof(word);
-            }
-            // use heap chunk
-            storeWord_ofObject_withValue(wordIndex, objectPointer, word);
+            memcpy(chunk, &imageBytes[offset], objectSize * sizeof(std::uint16_t));
         }
         
         destinationWord += space;
@@ -282,8 +532,12 @@ bool ObjectMemory::loadSnapshot(IFileSystem *fileSystem, const char *fileName)
             fd = fileSystem->open_file(fileName);
 
             if (fd == -1) {
-                CLogger::Get ()->Write ("objmemory", LogDebug, "Unable to load snapshot", fileName);
-                return false;
+                // Only the backup exists if a save stopped between the renames
+                std::string backupName = std::string(fileName) + SnapshotBackupSuffix;
+                CLogger::Get ()->Write ("objmemory", LogDebug, "Unable to load snapshot %s, trying %s", fileName, backupName.c_str());
+                fd = fileSystem->open_file(backupName.c_str());
+                if (fd == -1)
+                    return false;
             }
             break;
         default:
@@ -292,88 +546,347 @@ bool ObjectMemory::loadSnapshot(IFileSystem *fileSystem, const char *fileName)
             break;
     }
 
+    std::uint32_t start = hal->get_msclock();
+    imageBytes = ___files_snapshot_im;
+    imageLength = ___files_snapshot_im_len;
+#ifdef DELTA_SNAPSHOTS
+    std::string deltaName = std::string(fileName) + SnapshotDeltaSuffix;
+    int deltaFd = fileSystem->open_file(deltaName.c_str());
+    bool merged = false;
+#endif
+    if (bootmode == 1) {
+        // A compressed snapshot cannot be read object by object
+        std::uint8_t magic[sizeof(SnapshotMagic)];
+        if (fileSystem->read(fd, (char *) magic, sizeof(magic)) == sizeof(magic) &&
+            isCompressedSnapshot(magic, sizeof(magic)))
+            bootmode = 2;
+#ifdef DELTA_SNAPSHOTS
+        // ... nor one with a delta, which is merged in memory
+        if (deltaFd != -1)
+            bootmode = 2;
+#endif
+        fileSystem->seek_to(fd, 0);
+    }
     if (bootmode == 2) { // #if LOAD_FAST_FROM_SD
-        if (((unsigned) fileSystem->file_size(fd)) > sizeof(___files_snapshot_im)) {
-            CLogger::Get ()->Write ("objmemory", LogDebug, "Snapshot file %s too large", fileName);
-            return false;
-        }
+        // The whole file in one read, into a buffer of its size
+        imageLength = fileSystem->file_size(fd);
+        imageBuffer = new std::uint8_t[imageLength];
+        imageBytes = imageBuffer;
 
         int bytes;
-        bytes = fileSystem->read(fd, (char *)___files_snapshot_im, fileSystem->file_size(fd));
-        if (bytes != fileSystem->file_size(fd)) {
+        bytes = fileSystem->read(fd, (char *)imageBuffer, imageLength);
+        if (bytes != imageLength) {
             CLogger::Get ()->Write ("objmemory", LogDebug, "Short read, got %d bytes, expected %d", 
-                bytes, fileSystem->file_size(fd));
+                bytes, imageLength);
+            fileSystem->close_file(fd);
+            delete [] imageBuffer;
+            imageBuffer = 0;
+#ifdef DELTA_SNAPSHOTS
+            if (deltaFd != -1)
+                fileSystem->close_file(deltaFd);
+#endif
+            return false;
+        }
+    }
+#ifdef DELTA_SNAPSHOTS
+    // A delta names the snapshot file it applies to by length and checksum
+    baseLength = 0;
+    if (bootmode != 1) {
+        baseLength = imageLength;
+        baseChecksum = checksumOf(imageBytes, imageLength, SnapshotChecksumSeed);
+    } else if (checksumOfFile(fileSystem, fd, &baseChecksum)) {
+        baseLength = fileSystem->file_size(fd);
+        fileSystem->seek_to(fd, 0);
+    }
+#endif
+    if (bootmode != 1 && isCompressedSnapshot(imageBytes, imageLength)) {
+        int compressedLength = imageLength;
+        std::uint8_t *image = decompressSnapshot(imageBytes, imageLength, SnapshotBufferSize, &imageLength);
+        delete [] imageBuffer;
+        imageBuffer = image;
+        imageBytes = image;
+        if (image == 0) {
+            CLogger::Get ()->Write ("objmemory", LogDebug, "Compressed snapshot is damaged");
+            if (fd != -1)
+                fileSystem->close_file(fd);
+#ifdef DELTA_SNAPSHOTS
+            if (deltaFd != -1)
+                fileSystem->close_file(deltaFd);
+#endif
             return false;
         }
+        CLogger::Get ()->Write ("objmemory", LogDebug, "Snapshot of %d bytes decompressed to %d bytes",
+                                compressedLength, imageLength);
+    }
+#ifdef DELTA_SNAPSHOTS
+    if (deltaFd != -1) {
+        // The snapshot alone is loaded if the delta does not belong to it
+        merged = mergeDeltaSnapshot(fileSystem, deltaFd);
+        fileSystem->close_file(deltaFd);
+        if (!merged)
+            CLogger::Get ()->Write ("objmemory", LogNotice, "Delta snapshot %s ignored", deltaName.c_str());
     }
+#endif
      
     bool succeeded = loadObjectTable(fileSystem, fd) && loadObjects(fileSystem, fd);
     
     if (bootmode > 0) {
         fileSystem->close_file(fd);
     }
-    
+    if (imageBuffer) {
+        // The heap has its own copy of every object
+        delete [] imageBuffer;
+        imageBuffer = 0;
+        imageBytes = ___files_snapshot_im;
+    }
+    CLogger::Get ()->Write ("objmemory", LogDebug, "Snapshot loaded in %u ms", hal->get_msclock() - start);
+    
+#ifdef DELTA_SNAPSHOTS
+    // The merge has set up the base from the snapshot file. Loading wrote
+    // every page.
+    if (succeeded && !merged)
+        resetDeltaBaseline();
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+#endif
+#ifdef GC_DEFERRED_REF_COUNT
+    // Snapshots have every context field counted
+    if (succeeded)
+        adjustCountsFromContextFields(-1);
+#endif
+#ifdef GC_INCREMENTAL
+    oopsAfterLastCycle = freeOops;
+    wordsAfterLastCycle = freeWords;
+#endif
     return succeeded;
 }
 
 
-bool ObjectMemory::padToPage(IFileSystem *fileSystem, int fd)
+// FNV-1a
+std::uint32_t ObjectMemory::checksumOf(const std::uint8_t *bytes, int count, std::uint32_t checksum)
+{
+    while (count-- > 0)
+        checksum = (checksum ^ *bytes++) * 16777619u;
+    return checksum;
+}
+
+
+bool ObjectMemory::checksumOfFile(IFileSystem *fileSystem, int fd, std::uint32_t *checksum)
 {
-    int pos = fileSystem->tell(fd);
-    int desired = ((pos + 512 - 1) / 512) * 512;
-    std::uint16_t word = 0;
-    int pad = (desired - pos) / sizeof(word);
-    while (pad-- > 0)
+    int bytes;
+    
+    *checksum = SnapshotChecksumSeed;
+    while ((bytes = fileSystem->read(fd, (char *) snapshotBuffer, SnapshotBufferSize)) > 0)
+        *checksum = checksumOf(snapshotBuffer, bytes, *checksum);
+    return bytes == 0;
+}
+
+
+bool ObjectMemory::verifySnapshot(IFileSystem *fileSystem, const char *fileName)
+{
+    int fd = fileSystem->open_file(fileName);
+    if (fd == -1)
+        return false;
+    
+    std::uint32_t checksum;
+    int length = fileSystem->file_size(fd);
+    bool readable = checksumOfFile(fileSystem, fd, &checksum);
+    fileSystem->close_file(fd);
+    
+    if (!readable || length != snapshotFileLength || checksum != snapshotChecksum)
     {
-        if (fileSystem->write(fd, (char *) &word, sizeof(word)) != sizeof(word))
-            return false;
+        CLogger::Get ()->Write ("objmemory", LogNotice, "Snapshot %s does not read back: %d bytes, expected %d",
+                                fileName, length, snapshotFileLength);
+        return false;
     }
+    return true;
+}
+
+
+bool ObjectMemory::snapshotFileWrite(const std::uint8_t *bytes, int count)
+{
+    if (snapshotFileSystem->write(snapshotFile, (const char *) bytes, count) != count)
+        return false;
     
+    snapshotChecksum = checksumOf(bytes, count, snapshotChecksum);
+    snapshotFileLength += count;
     return true;
- }
+}
+
+
+bool ObjectMemory::snapshotFlush()
+{
+    if (snapshotBufferCount == 0)
+        return true;
+    
+#ifdef COMPRESSED_SNAPSHOTS
+    std::uint32_t lengths[2];   // compressed, original
+    int compressedLength = compressSnapshotBlock(snapshotBuffer, snapshotBufferCount,
+                                                 compressedBuffer, compressionPositions);
+    lengths[1] = snapshotBufferCount;
+    lengths[0] = compressedLength < 0 ? snapshotBufferCount : compressedLength;
+    if (!snapshotFileWrite((std::uint8_t *) lengths, sizeof(lengths)) ||
+        !snapshotFileWrite(compressedLength < 0 ? snapshotBuffer : compressedBuffer, lengths[0]))
+        return false;
+#else
+    if (!snapshotFileWrite(snapshotBuffer, snapshotBufferCount))
+        return false;
+#endif
+    
+    snapshotBufferCount = 0;
+    if (snapshotPosition / SnapshotProgressInterval != (snapshotPosition - SnapshotBufferSize) / SnapshotProgressInterval)
+        CLogger::Get ()->Write ("objmemory", LogDebug, "%d KB written", snapshotPosition / 1024);
+    return true;
+}
+
+
+bool ObjectMemory::snapshotWrite(const void *data, int bytes)
+{
+    const std::uint8_t *source = (const std::uint8_t *) data;
+    
+    while (bytes > 0)
+    {
+        int count = std::min(bytes, SnapshotBufferSize - snapshotBufferCount);
+        memcpy(snapshotBuffer + snapshotBufferCount, source, count);
+        snapshotBufferCount += count;
+        snapshotPosition += count;
+        source += count;
+        bytes -= count;
+        if (snapshotBufferCount == SnapshotBufferSize && !snapshotFlush())
+            return false;
+    }
+    return true;
+}
+
+
+void ObjectMemory::startSnapshotFile(IFileSystem *fileSystem, int fd)
+{
+    snapshotFileSystem = fileSystem;
+    snapshotFile = fd;
+    snapshotBufferCount = 0;
+    snapshotPosition = 0;
+    snapshotFileLength = 0;
+    snapshotChecksum = SnapshotChecksumSeed;
+}
+
+
+bool ObjectMemory::padToPage()
+{
+    int desired = ((snapshotPosition + 512 - 1) / 512) * 512;
+    static const std::uint8_t zeros[512] = {0};
+    
+    return snapshotWrite(zeros, desired - snapshotPosition);
+}
 
 bool ObjectMemory::saveSnapshot(IFileSystem *fileSystem, const char *imageFileName)
 {
+    std::string temporaryName = std::string(imageFileName) + SnapshotTemporarySuffix;
+    std::string backupName = std::string(imageFileName) + SnapshotBackupSuffix;
     
-    int fd = fileSystem->create_file(imageFileName);
+    int fd = fileSystem->create_file(temporaryName.c_str());
     if (fd == -1)
         return false;
-    bool success = saveObjects(fileSystem, fd);
+    
+    std::uint32_t start = hal->get_msclock();
+    startSnapshotFile(fileSystem, fd);
+#ifdef COMPRESSED_SNAPSHOTS
+    bool success = snapshotFileWrite(SnapshotMagic, sizeof(SnapshotMagic));
+#else
+    bool success = true;
+#endif
+#ifdef GC_DEFERRED_REF_COUNT
+    // Write ordinary counts, zero counts mark free chunks in the image
+    adjustCountsFromContextFields(1);
+    success = success && saveObjects() && snapshotFlush();
+    adjustCountsFromContextFields(-1);
+#else
+    success = success && saveObjects() && snapshotFlush();
+#endif
+    // Drop what was preallocated but not needed
+    success = success && fileSystem->truncate_to(fd, snapshotFileLength) && fileSystem->file_flush(fd);
     
     fileSystem->close_file(fd);
-    return success;
+    success = success && verifySnapshot(fileSystem, temporaryName.c_str());
+    if (!success)
+    {
+        fileSystem->delete_file(temporaryName.c_str());
+        return false;
+    }
+    
+    // There is no image to back up the first time it is saved under a name
+    fileSystem->delete_file(backupName.c_str());
+    fileSystem->rename_file(imageFileName, backupName.c_str());
+    if (!fileSystem->rename_file(temporaryName.c_str(), imageFileName))
+    {
+        fileSystem->rename_file(backupName.c_str(), imageFileName);
+        return false;
+    }
+    
+#ifdef DELTA_SNAPSHOTS
+    // This is the new base, a delta of the old one is useless
+    fileSystem->delete_file((std::string(imageFileName) + SnapshotDeltaSuffix).c_str());
+    baseLength = snapshotFileLength;
+    baseChecksum = snapshotChecksum;
+#ifdef GC_DEFERRED_REF_COUNT
+    adjustCountsFromContextFields(1);
+    resetDeltaBaseline();
+    adjustCountsFromContextFields(-1);
+#else
+    resetDeltaBaseline();
+#endif
+#endif
+    
+    CLogger::Get ()->Write ("objmemory", LogNotice, "Snapshot %s saved, %d bytes (%d in the file) in %u ms",
+                            imageFileName, snapshotPosition, snapshotFileLength, hal->get_msclock() - start);
+    return true;
     
 }
 
-bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd)
+bool ObjectMemory::saveObjects()
 {
     // Avoid dumping out the entire object table -- we only need to write entries up until
     // the last OT entry that references an object
     int lastUsedObjectPointer = NonPointer;
+    std::int32_t objectSpaceLength = 0;
     for(int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2)
     {
          if (hasObject(objectPointer))
+         {
             lastUsedObjectPointer = objectPointer;
+            objectSpaceLength += sizeBitsOf(objectPointer);
+         }
     }
     
-    int storedObjectTableLength = lastUsedObjectPointer + 2;
+    std::int32_t storedObjectTableLength = lastUsedObjectPointer + 2;
     
-    std::int32_t placeHolder[2] = {0};
+#ifdef EXTENDED_OBJECT_MEMORY
+    // The object table entries of the image address 16 segments
+    if (objectSpaceLength > RealWordMemory::ImageSegmentCount * RealWordMemory::SegmentSize)
+    {
+        CLogger::Get ()->Write ("objmemory", LogNotice, "Objects (%d words) do not fit into a snapshot", objectSpaceLength);
+        return false;
+    }
+#endif
     
-    // Write place holder value for object space length and object table length
-    if (fileSystem->write(fd, (char *) &placeHolder, sizeof(placeHolder)) != sizeof(placeHolder))
+    // Contiguous clusters keep the writes fast, the file is truncated to
+    // the bytes actually written. Saving works without them.
+    int estimatedLength = 3 * 512 + objectSpaceLength * sizeof(std::uint16_t) + storedObjectTableLength * sizeof(std::uint16_t);
+    if (!snapshotFileSystem->preallocate(snapshotFile, estimatedLength))
+        CLogger::Get ()->Write ("objmemory", LogDebug, "No contiguous space for %d bytes", estimatedLength);
+    
+    // The lengths are known up front, the file is written front to back
+    if (!snapshotWrite(&objectSpaceLength, sizeof(objectSpaceLength)) ||
+        !snapshotWrite(&storedObjectTableLength, sizeof(storedObjectTableLength)))
         return false;
 
     // Write two zero bytes indicating interchange format
     std::uint8_t interchange[2] = {0};
-    if (fileSystem->write(fd, (char *) &interchange, sizeof(interchange)) !=  sizeof(interchange))
+    if (!snapshotWrite(&interchange, sizeof(interchange)))
         return false;
 
-    if (!padToPage(fileSystem, fd)) // Advance to next page before writing objects
+    if (!padToPage()) // Advance to next page before writing objects
         return false;
         
     // Write objects
-    std::int32_t objectSpaceLength = 0;
     for(int objectPointer = 2; objectPointer < storedObjectTableLength; objectPointer += 2)
     {
         if (!hasObject(objectPointer)) continue;
@@ -383,21 +896,15 @@ bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd)
         std::uint16_t objectSize = sizeBitsOf(objectPointer);
         header[0] = objectSize;
         header[1] = (std::uint16_t) fetchClassOf(objectPointer);
-        if (fileSystem->write(fd, (char *) &header, sizeof(header)) != sizeof(header))
+        if (!snapshotWrite(&header, sizeof(header)))
+            return false;
+        // The fields are contiguous in the heap
+        if (!snapshotWrite(fieldAddressOf(objectPointer), fetchWordLengthOf(objectPointer) * sizeof(std::uint16_t)))
             return false;
-        int wordLengthOfObject = fetchWordLengthOf(objectPointer);
-        for(int wordIndex = 0; wordIndex < wordLengthOfObject; wordIndex++ )
-        {
-            std::uint16_t word = (std::uint16_t) fetchWord_ofObject(wordIndex, objectPointer);
-            if (fileSystem->write(fd, (char *) &word, sizeof(word)) != sizeof(word))
-                return false;
-        }
-        
-        objectSpaceLength += objectSize;
     }
     
 
-   if (!padToPage(fileSystem, fd)) // Advance to next page before writing object table
+   if (!padToPage()) // Advance to next page before writing object table
        return false;
 
     // Write object table
@@ -406,6 +913,7 @@ bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd)
     {
         std::uint16_t oldOTValue = ot(objectPointer);
         std::uint16_t oldOTLocation = locationBitsOf(objectPointer);
+        int oldOTSegment = segmentBitsOf(objectPointer); // ot: has only 4 bits of it
         
         if (objectPointer >= 2)
         {
@@ -444,22 +952,302 @@ bool ObjectMemory::saveObjects(IFileSystem *fileSystem, int fd)
    
         // Restore OT entry
         ot_put(objectPointer, oldOTValue);
+        segmentBitsOf_put(objectPointer, oldOTSegment);
         locationBitsOf_put(objectPointer, oldOTLocation);
         
         // Write this entry
-        if (fileSystem->write(fd, (char *) &words, sizeof(words)) != sizeof(words))
+        if (!snapshotWrite(&words, sizeof(words)))
             return false;
 
     }
     
-    // Now we can go back fill in the values for the image header.
-    fileSystem->seek_to(fd, 0);
-    fileSystem->write(fd, (char *) &objectSpaceLength, sizeof(objectSpaceLength));
-    fileSystem->write(fd, (char *) &storedObjectTableLength, sizeof(storedObjectTableLength));
+    return true;
+}
+
+#ifdef DELTA_SNAPSHOTS
+
+int ObjectMemory::imageEntryOf(int objectPointer)
+{
+    // Free chunks are not saved, their entries are free in the image
+    if (!hasObject(objectPointer))
+        return FreeEntryInImage;
+    return ot(objectPointer) & ~SegmentBitsInImage;
+}
+
+
+bool ObjectMemory::isChunkDirty(int objectPointer)
+{
+    const std::uint16_t *chunk = fieldAddressOf(objectPointer) - HeaderSize;
+    int first = (int) (chunk - heapBase) >> DirtyPageShift;
+    int last = (int) (chunk + spaceOccupiedBy(objectPointer) - 1 - heapBase) >> DirtyPageShift;
+    
+    for (int page = first; page <= last; page++)
+        if ((dirtyPages[page >> 5] >> (page & 31)) & 1)
+            return true;
+    return false;
+}
+
+
+void ObjectMemory::resetDeltaBaseline()
+{
+    baseObjectTable[0] = FreeEntryInImage;
+    for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2)
+        baseObjectTable[objectPointer >> 1] = imageEntryOf(objectPointer);
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+    memset(changedObjects, 0, sizeof(changedObjects));
+}
+
+
+bool ObjectMemory::mergeDeltaSnapshot(IFileSystem *fileSystem, int fd)
+{
+    int deltaLength = fileSystem->file_size(fd);
+    if (deltaLength <= 0)
+        return false;
+    std::vector<std::uint8_t> delta(deltaLength);
+    if (fileSystem->read(fd, (char *) delta.data(), deltaLength) != deltaLength)
+        return false;
+    if (isCompressedSnapshot(delta.data(), deltaLength))
+    {
+        std::uint8_t *decompressed = decompressSnapshot(delta.data(), deltaLength, SnapshotBufferSize, &deltaLength);
+        if (decompressed == 0)
+            return false;
+        delta.assign(decompressed, decompressed + deltaLength);
+        delete [] decompressed;
+    }
+    
+    // The base snapshot must be the one loaded
+    std::int32_t lengthOfBase;
+    std::uint32_t checksumOfBase;
+    const int headerLength = sizeof(DeltaMagic) + sizeof(lengthOfBase) + sizeof(checksumOfBase);
+    if (deltaLength < headerLength || memcmp(delta.data(), DeltaMagic, sizeof(DeltaMagic)) != 0)
+        return false;
+    memcpy(&lengthOfBase, &delta[sizeof(DeltaMagic)], sizeof(lengthOfBase));
+    memcpy(&checksumOfBase, &delta[sizeof(DeltaMagic) + sizeof(lengthOfBase)], sizeof(checksumOfBase));
+    if (baseLength == 0 || lengthOfBase != baseLength || checksumOfBase != baseChecksum)
+        return false;
+    
+    // The object table entries of the snapshot and where its objects are
+    // (at the size word)
+    std::int32_t objectTableLength;
+    memcpy(&objectTableLength, &imageBytes[4], sizeof(objectTableLength));
+    int objectTableOffset = imageLength - objectTableLength * sizeof(std::uint16_t);
+    std::vector<std::uint16_t> entries(ObjectTableSize / 2, FreeEntryInImage);
+    std::vector<const std::uint8_t *> objects(ObjectTableSize / 2, nullptr);
+    
+    for (int objectPointer = 2; objectPointer < std::min((int) objectTableLength, ObjectTableSize); objectPointer += 2)
+    {
+        std::uint16_t words[2];
+        memcpy(words, &imageBytes[objectTableOffset + objectPointer * sizeof(std::uint16_t)], sizeof(words));
+        if (words[0] & FreeEntryInImage)
+            continue;
+        int objectImageWordAddress = ((words[0] & SegmentBitsInImage) << 16) + words[1];
+        entries[objectPointer >> 1] = words[0] & ~SegmentBitsInImage;
+        objects[objectPointer >> 1] = &imageBytes[ObjectSpaceBaseInImage + objectImageWordAddress * sizeof(std::uint16_t)];
+    }
+    std::vector<std::uint16_t> baseEntries(entries);
+    
+    // Then the records of the delta
+    std::vector<int> changed;
+    int records = 0;
+    for (int position = headerLength; position < deltaLength; records++)
+    {
+        std::uint16_t record[3];    // oop, entry, size or 0
+        if (deltaLength - position < (int) sizeof(record))
+            return false;
+        memcpy(record, &delta[position], sizeof(record));
+        
+        int objectPointer = record[0];
+        if (objectPointer < 2 || objectPointer >= ObjectTableSize || (objectPointer & 1) != 0)
+            return false;
+        entries[objectPointer >> 1] = record[1];
+        if (record[2] != 0)
+        {
+            // The size is the first word of the object
+            if (record[2] < HeaderSize)
+                return false;
+            objects[objectPointer >> 1] = &delta[position + 2 * sizeof(std::uint16_t)];
+            position += (2 + record[2]) * sizeof(std::uint16_t);
+            if (position > deltaLength)
+                return false;
+            changed.push_back(objectPointer);
+        }
+        else
+            position += sizeof(record);
+        
+        if (record[1] & FreeEntryInImage)
+            objects[objectPointer >> 1] = nullptr;
+        else if (objects[objectPointer >> 1] == nullptr)
+            return false;
+    }
+    
+    // Lay out the merged image as saveObjects does
+    std::int32_t objectSpaceLength = 0;
+    int lastUsedObjectPointer = NonPointer;
+    for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2)
+    {
+        if (objects[objectPointer >> 1] == nullptr)
+            continue;
+        std::uint16_t objectSize;
+        memcpy(&objectSize, objects[objectPointer >> 1], sizeof(objectSize));
+        objectSpaceLength += objectSize;
+        lastUsedObjectPointer = objectPointer;
+    }
+    if (objectSpaceLength > RealWordMemory::ImageSegmentCount * RealWordMemory::SegmentSize)
+        return false;
+    
+    std::int32_t storedObjectTableLength = lastUsedObjectPointer + 2;
+    int objectTableStart = ObjectSpaceBaseInImage + ((objectSpaceLength * sizeof(std::uint16_t) + 511) / 512) * 512;
+    int mergedLength = objectTableStart + storedObjectTableLength * sizeof(std::uint16_t);
+    std::uint8_t *merged = new std::uint8_t[mergedLength];
+    
+    memset(merged, 0, objectTableStart);
+    memcpy(&merged[0], &objectSpaceLength, sizeof(objectSpaceLength));
+    memcpy(&merged[4], &storedObjectTableLength, sizeof(storedObjectTableLength));
+    // Oop 0 is reserved, its entry is kept
+    memcpy(&merged[objectTableStart], &imageBytes[objectTableOffset], 2 * sizeof(std::uint16_t));
+    
+    int objectImageWordAddress = 0;
+    for (int objectPointer = 2; objectPointer < storedObjectTableLength; objectPointer += 2)
+    {
+        std::uint16_t words[2] = { FreeEntryInImage, 0 };
+        const std::uint8_t *object = objects[objectPointer >> 1];
+        if (object)
+        {
+            std::uint16_t objectSize;
+            memcpy(&objectSize, object, sizeof(objectSize));
+            memcpy(&merged[ObjectSpaceBaseInImage + objectImageWordAddress * sizeof(std::uint16_t)],
+                   object, objectSize * sizeof(std::uint16_t));
+            words[0] = entries[objectPointer >> 1] | (objectImageWordAddress >> 16);
+            words[1] = objectImageWordAddress & 0xffff;
+            objectImageWordAddress += objectSize;
+        }
+        memcpy(&merged[objectTableStart + objectPointer * sizeof(std::uint16_t)], words, sizeof(words));
+    }
+    
+    delete [] imageBuffer;
+    imageBuffer = merged;
+    imageBytes = merged;
+    imageLength = mergedLength;
+    
+    // Later deltas still refer to the snapshot file, and include what this
+    // one changed
+    std::copy(baseEntries.begin(), baseEntries.end(), baseObjectTable);
+    memset(changedObjects, 0, sizeof(changedObjects));
+    for (int objectPointer : changed)
+        setBit(changedObjects, objectPointer);
+    
+    CLogger::Get ()->Write ("objmemory", LogNotice, "Delta snapshot merged, %d entries (%d objects)",
+                            records, (int) changed.size());
+    return true;
+}
+
+
+bool ObjectMemory::saveDeltaSnapshot(IFileSystem *fileSystem, const char *imageFileName)
+{
+    if (baseLength == 0)
+    {
+        CLogger::Get ()->Write ("objmemory", LogNotice, "No base snapshot for a delta");
+        return false;
+    }
+    
+#ifdef EXTENDED_OBJECT_MEMORY
+    // It is merged into a snapshot, which has to fit (see saveObjects)
+    std::int32_t objectSpaceLength = 0;
+    for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2)
+        if (hasObject(objectPointer))
+            objectSpaceLength += sizeBitsOf(objectPointer);
+    if (objectSpaceLength > RealWordMemory::ImageSegmentCount * RealWordMemory::SegmentSize)
+    {
+        CLogger::Get ()->Write ("objmemory", LogNotice, "Objects (%d words) do not fit into a snapshot", objectSpaceLength);
+        return false;
+    }
+#endif
+    
+    std::string deltaName = std::string(imageFileName) + SnapshotDeltaSuffix;
+    std::string temporaryName = deltaName + SnapshotTemporarySuffix;
+    
+    int fd = fileSystem->create_file(temporaryName.c_str());
+    if (fd == -1)
+        return false;
+    
+    std::uint32_t start = hal->get_msclock();
+    startSnapshotFile(fileSystem, fd);
+#ifdef COMPRESSED_SNAPSHOTS
+    bool success = snapshotFileWrite(SnapshotMagic, sizeof(SnapshotMagic));
+#else
+    bool success = true;
+#endif
+    int records = 0, objects = 0;
+#ifdef GC_DEFERRED_REF_COUNT
+    adjustCountsFromContextFields(1);
+    success = success && saveChangedObjects(records, objects) && snapshotFlush();
+    adjustCountsFromContextFields(-1);
+#else
+    success = success && saveChangedObjects(records, objects) && snapshotFlush();
+#endif
+    success = success && fileSystem->file_flush(fd);
+    
+    fileSystem->close_file(fd);
+    success = success && verifySnapshot(fileSystem, temporaryName.c_str());
+    if (!success)
+    {
+        fileSystem->delete_file(temporaryName.c_str());
+        return false;
+    }
     
+    // Without a delta the base snapshot is loaded as it is
+    fileSystem->delete_file(deltaName.c_str());
+    if (!fileSystem->rename_file(temporaryName.c_str(), deltaName.c_str()))
+        return false;
+    
+    CLogger::Get ()->Write ("objmemory", LogNotice, "Delta snapshot %s saved, %d entries (%d objects), %d bytes in %u ms",
+                            deltaName.c_str(), records, objects, snapshotFileLength, hal->get_msclock() - start);
     return true;
 }
 
+
+bool ObjectMemory::saveChangedObjects(int &records, int &objects)
+{
+    std::int32_t lengthOfBase = baseLength;
+    if (!snapshotWrite(DeltaMagic, sizeof(DeltaMagic)) ||
+        !snapshotWrite(&lengthOfBase, sizeof(lengthOfBase)) ||
+        !snapshotWrite(&baseChecksum, sizeof(baseChecksum)))
+        return false;
+    
+    for (int objectPointer = 2; objectPointer < ObjectTableSize; objectPointer += 2)
+    {
+        int entry = imageEntryOf(objectPointer);
+        int baseEntry = baseObjectTable[objectPointer >> 1];
+        
+        // The object goes with the entry if it is new or has other flags,
+        // was swapped in by become:, written to, or is a context (whose
+        // fields the interpreter writes directly). Otherwise only the count
+        // may have changed.
+        bool withObject = (entry & FreeEntryInImage) == 0 &&
+                          (((entry ^ baseEntry) & 0xff) != 0 || testBit(changedObjects, objectPointer) ||
+                           isContext(objectPointer) || isChunkDirty(objectPointer));
+        if (!withObject && entry == baseEntry)
+            continue;
+        
+        std::uint16_t record[4];    // oop, entry, size or 0, class
+        record[0] = objectPointer;
+        record[1] = entry;
+        record[2] = withObject ? sizeBitsOf(objectPointer) : 0;
+        record[3] = withObject ? fetchClassOf(objectPointer) : 0;
+        if (!snapshotWrite(record, (withObject ? 4 : 3) * sizeof(std::uint16_t)))
+            return false;
+        if (withObject && !snapshotWrite(fieldAddressOf(objectPointer), fetchWordLengthOf(objectPointer) * sizeof(std::uint16_t)))
+            return false;
+        
+        records++;
+        if (withObject)
+            objects++;
+    }
+    return true;
+}
+
+#endif
+
 // sweepCurrentSegmentFrom:
 int ObjectMemory::sweepCurrentSegmentFrom(int lowWaterMark)
 {
@@ -558,12 +1346,76 @@ void ObjectMemory::compactCurrentSegment()
     lowWaterMark = abandonFreeChunksInSegment(currentSegment);
     if (lowWaterMark < HeapSpaceStop)
     {
+#ifdef DELTA_SNAPSHOTS
+        // Objects move to other pages
+        markDirty(wordMemory.segment_word_address(currentSegment, lowWaterMark),
+                  (HeapSpaceStop + 1 - lowWaterMark) * sizeof(std::uint16_t));
+#endif
         reverseHeapPointersAbove(lowWaterMark);
         bigSpace = sweepCurrentSegmentFrom(lowWaterMark);
         deallocate(obtainPointer_location(HeapSpaceStop + 1 - bigSpace, bigSpace));
     }
 }
 
+#ifdef SEGREGATED_FIT_ALLOCATION
+// compactAllSegments
+void ObjectMemory::compactAllSegments()
+{
+    int lowWaterMark[HeapSegmentCount];
+    int count = 0;
+    
+    // The free chunks give up their object table entries (and are marked
+    // with a NonPointer class, not that it matters here)
+    for(int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+        lowWaterMark[segment - FirstHeapSegment] = abandonFreeChunksInSegment(segment);
+    
+    // Everything else that is not free is an object, including the garbage
+    // and kept contexts with a zero count (oop 0 is reserved, see loadObjects)
+    for(int objectPointer = 2; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+    {
+        if (freeBitOf(objectPointer) != 0)
+            continue;
+        int segment = segmentBitsOf(objectPointer);
+        int location = locationBitsOf(objectPointer);
+        int segmentLowWaterMark = lowWaterMark[segment - FirstHeapSegment];
+        if (segmentLowWaterMark < HeapSpaceStop && location >= segmentLowWaterMark)
+            compactionOrder[count++] = ((std::uint64_t) segment << 32) |
+                                       ((std::uint64_t) location << 16) | objectPointer;
+    }
+    std::sort(compactionOrder, compactionOrder + count);
+    
+    int index = 0;
+    for(int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+    {
+        int destination = lowWaterMark[segment - FirstHeapSegment];
+        if (destination >= HeapSpaceStop)
+            continue; // nothing was free
+#ifdef DELTA_SNAPSHOTS
+        // Objects move to other pages
+        markDirty(wordMemory.segment_word_address(segment, destination),
+                  (HeapSpaceStop + 1 - destination) * sizeof(std::uint16_t));
+#endif
+        
+        for(; index < count && (int) (compactionOrder[index] >> 32) == segment; index++)
+        {
+            int objectPointer = (int) (compactionOrder[index] & 0xffff);
+            int space = spaceOccupiedBy(objectPointer);
+            
+            std::uint16_t *from = wordMemory.segment_word_address(segment, locationBitsOf(objectPointer));
+            memmove(wordMemory.segment_word_address(segment, destination), from, space * sizeof(std::uint16_t));
+            locationBitsOf_put(objectPointer, destination);
+            destination += space;
+        }
+        
+        currentSegment = segment;
+        if (HeapSpaceStop + 1 - destination >= HeaderSize)
+            deallocate(obtainPointer_location(HeapSpaceStop + 1 - destination, destination));
+    }
+    currentSegment = FirstHeapSegment;
+}
+#endif
+
+
 // Force a garbage collection
 void ObjectMemory::garbageCollect()
 {
@@ -688,9 +1540,49 @@ void ObjectMemory::reclaimInaccessibleObjects()
    	self rectifyCountsAndDeallocateGarbage
    */
 
+#ifdef HEAP_PROFILING
+    // Free chunks and kept contexts are unmarked as well, but they are no
+    // garbage to profile (kept contexts were counted when they were freed)
+    memset(selectionBits, 0, sizeof(selectionBits));
+    for(int segment = FirstHeapSegment; segment <= LastHeapSegment; segment++)
+        for(int size = HeaderSize; size <= BigSize; size++)
+            for(int objectPointer = headOfFreeChunkList_inSegment(size, segment);
+                objectPointer != NonPointer; objectPointer = classBitsOf(objectPointer))
+                setBit(selectionBits, objectPointer);
+#ifdef CONTEXT_FREE_LISTS
+    for(int index = 0; index < 2; index++)
+        for(int i = 0; i < contextFreeListCount[index]; i++)
+            setBit(selectionBits, contextFreeList[index][i]);
+#endif
+#endif
+#ifdef CONTEXT_FREE_LISTS
+    // The kept contexts have a zero count and are reclaimed like any garbage
+    resetContextFreeLists();
+#endif
+#ifdef GC_DEFERRED_REF_COUNT
+    // The collection finds all zero count objects that are still alive
+    resetZeroCountTable();
+#endif
+#ifdef GC_INCREMENTAL
+    // Abandon the incremental cycle, its marks are no longer needed
+    incrementalPhase = IncrementalIdle;
+    markStackCount = 0;
+    markStackOverflowed = false;
+#endif
     zeroReferenceCounts();
     markAccessibleObjects();
     rectifyCountsAndDeallocateGarbage();
+#ifdef EXPLICIT_MARK_STACK
+    if (traversalOverflows)
+    {
+        CLogger::Get ()->Write ("objmemory", LogDebug, "%u traversals overflowed the mark stack", traversalOverflows);
+        traversalOverflows = 0;
+    }
+#endif
+#ifdef GC_INCREMENTAL
+    oopsAfterLastCycle = freeOops;
+    wordsAfterLastCycle = freeWords;
+#endif
 }
 
 
@@ -710,6 +1602,11 @@ int ObjectMemory::markObjectsAccessibleFrom(int rootObjectPointer)
    */
     return forAllObjectsAccessibleFrom_suchThat_do(rootObjectPointer,
        [this](int objectPointer) { // the predicate tests for an unmarked object and marks it
+#ifdef GC_DEFERRED_REF_COUNT
+            // a stack field above the stack pointer may still hold a released oop
+            if (freeBitOf(objectPointer))
+                return false;
+#endif
             bool unmarked = countBitsOf(objectPointer) == 0;
             if (unmarked)
             {
@@ -738,11 +1635,165 @@ void ObjectMemory::markAccessibleObjects()
     {
         addRoot(i);
     }
-
-    if (gcNotification)
-        gcNotification->prepareForCollection();
-    
+
+    if (gcNotification)
+        gcNotification->prepareForCollection();
+    
+}
+#endif
+
+
+#ifdef GC_INCREMENTAL
+
+// A cycle marks from the same roots as markAccessibleObjects, with reference
+// counting going on between the slices:
+// - storePointer:ofObject:withValue: grays the stored object, and objects
+//   allocated during the cycle are black
+// - the interpreter pushes without going through storePointer, so the roots
+//   and all marked contexts are scanned again when the gray stack runs empty
+// - objects freed by reference counting have a zero count and are not
+//   scanned (their fields are gone) or swept
+void ObjectMemory::incrementalCollectionStep(std::uint32_t maxMilliseconds)
+{
+    std::uint32_t startTime = hal->get_msclock();
+    
+    if (incrementalPhase == IncrementalIdle)
+    {
+        if (freeOops > oopsAfterLastCycle - IncrementalTriggerOops &&
+            freeWords > wordsAfterLastCycle - IncrementalTriggerWords)
+            return;
+        startIncrementalCycle();
+    }
+    
+    do
+    {
+        if (incrementalPhase == IncrementalMarking)
+        {
+            if (incrementalMark(IncrementalSliceObjects))
+                finishIncrementalMarking();
+        }
+        else if (incrementalSweep(IncrementalSliceObjects))
+        {
+            incrementalPhase = IncrementalIdle;
+            incrementalCycleCount++;
+            CLogger::Get ()->Write ("objmemory", LogDebug, "incremental collection %u done, %d oops and %d words free",
+                                    incrementalCycleCount, freeOops, freeWords);
+            oopsAfterLastCycle = freeOops;
+            wordsAfterLastCycle = freeWords;
+            return;
+        }
+    } while (hal->get_msclock() - startTime < maxMilliseconds);
+}
+
+
+void ObjectMemory::startIncrementalCycle()
+{
+    memset(markBits, 0, sizeof(markBits));
+    markStackCount = 0;
+    markStackOverflowed = false;
+    incrementalPhase = IncrementalMarking;
+    
+    for(int i = 0; i <= LastSpecialOop; i += 2)
+        grayObject(i);
+    if (gcNotification)
+        gcNotification->prepareForCollection();
+}
+
+
+void ObjectMemory::scanGrayObject(int objectPointer)
+{
+    // Freed by reference counting since it was grayed
+    if (freeBitOf(objectPointer) != 0 || countBitsOf(objectPointer) == 0)
+        return;
+    
+    int limit = lastPointerOf(objectPointer) - 1;
+    // NB start at offset 1, which is the class
+    for(int offset = 1; offset <= limit; offset++)
+        grayObject(heapChunkOf_word(objectPointer, offset));
+}
+
+
+bool ObjectMemory::incrementalMark(int limit)
+{
+    while (limit-- > 0)
+    {
+        if (markStackCount == 0)
+        {
+            if (!markStackOverflowed)
+                return true;
+            
+            // Find the marked objects whose fields did not fit on the stack
+            markStackOverflowed = false;
+            for(int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+            {
+                if (testBit(markBits, objectPointer))
+                    scanGrayObject(objectPointer);
+            }
+            continue;
+        }
+        scanGrayObject(markStack[--markStackCount]);
+    }
+    return false;
+}
+
+
+void ObjectMemory::finishIncrementalMarking()
+{
+    // Atomic: the stores the write barrier did not see
+    if (gcNotification)
+        gcNotification->prepareForCollection();
+    for(int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+    {
+        if (testBit(markBits, objectPointer) && freeBitOf(objectPointer) == 0 &&
+            countBitsOf(objectPointer) != 0)
+        {
+            int classPointer = classBitsOf(objectPointer);
+            if (classPointer == ClassMethodContextPointer || classPointer == ClassBlockContextPointer)
+                scanGrayObject(objectPointer);
+        }
+    }
+    while (!incrementalMark(ObjectTableSize))
+        ;
+    
+    incrementalPhase = IncrementalSweeping;
+    sweepPointer = 0;
+}
+
+
+bool ObjectMemory::incrementalSweep(int limit)
+{
+    while (limit-- > 0)
+    {
+        if (sweepPointer > ObjectTableSize-2)
+            return true;
+        
+        int objectPointer = sweepPointer;
+        sweepPointer += 2;
+        
+        // Free entries, free chunks and the kept contexts are not swept
+        if (freeBitOf(objectPointer) != 0 || countBitsOf(objectPointer) == 0 ||
+            testBit(markBits, objectPointer))
+            continue;
+        
+        // Garbage. Only references to live objects are counted down, the
+        // other garbage is swept by itself.
+        int fieldLimit = lastPointerOf(objectPointer) - 1;
+        for(int offset = 1; offset <= fieldLimit; offset++)
+        {
+            int fieldPointer = heapChunkOf_word(objectPointer, offset);
+            if (!isIntegerObject(fieldPointer) && testBit(markBits, fieldPointer) &&
+                countBitsOf(fieldPointer) != 0)
+                countDown(fieldPointer);
+        }
+#ifdef HEAP_PROFILING
+        profileRelease(objectPointer, true);
+#endif
+        releaseZeroCountObject(objectPointer);
+        incrementalFreed++;
+    }
+    return false;
 }
+
 #endif
 
 
@@ -835,6 +1886,11 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage()
         }
     }
     
+#ifdef GC_DEFERRED_REF_COUNT
+    // Remembers the survivors for rebuildZeroCountTable (set up again by
+    // the next reconcileZeroCountTable)
+    memset(contextReferencedBits, 0, sizeof(contextReferencedBits));
+#endif
     // rectify counts, and deallocate garbage
     for(int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
     {
@@ -844,6 +1900,10 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage()
             if (count == 0)
             {
                 // unmarked, so deallocate it
+#ifdef HEAP_PROFILING
+                if (!testBit(selectionBits, objectPointer))
+                    profileRelease(objectPointer, true);
+#endif
                 freeWords += spaceOccupiedBy(objectPointer); //dbanay
                 deallocate(objectPointer);
             }
@@ -857,6 +1917,12 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage()
                 }
 
                 int limit = lastPointerOf(objectPointer)-1;
+#ifdef GC_DEFERRED_REF_COUNT
+                setBit(contextReferencedBits, objectPointer);
+                // temporaries and stack of a context are not counted
+                if (isContext(objectPointer))
+                    limit = std::min(limit, HeaderSize + ContextTempFrameStart - 1);
+#endif
                 // increment the reference count of each pointer
                 // NB start at offset 1, which is the class
                 for(int offset = 1; offset <= limit; offset++)
@@ -869,6 +1935,9 @@ void ObjectMemory::rectifyCountsAndDeallocateGarbage()
       
     countBitsOf_put(NilPointer, 128);
     
+#ifdef GC_DEFERRED_REF_COUNT
+    rebuildZeroCountTable();
+#endif
     freeOops = auditFreeOops();
 
     if (gcNotification) gcNotification->collectionCompleted();
@@ -999,6 +2068,16 @@ int ObjectMemory::allocate_odd_pointer_extra_class(
     }
     sizeBitsOf_put(objectPointer, size);
     freeOops--; // dbanay
+#ifdef HEAP_PROFILING
+    profileAllocation(classPointer);
+#endif
+#ifdef GC_INCREMENTAL
+    allocatedDuringCycle(objectPointer);
+#endif
+#ifdef GC_DEFERRED_REF_COUNT
+    // Not referenced yet, or only from the stack
+    toZeroCountTableAdd(objectPointer);
+#endif
     return objectPointer;
 }
 
@@ -1194,19 +2273,40 @@ int ObjectMemory::countDown(int rootObjectPointer)
             RUNTIME_CHECK(count >= 0);
             if (count < 127)
                 countBitsOf_put(objectPointer, count);
+#ifdef GC_DEFERRED_REF_COUNT
+            // a context may still refer to it, leave it to reconcileZeroCountTable
+            if (count == 0)
+                toZeroCountTableAdd(objectPointer);
+            return false;
+#else
             return count == 0;
+#endif
        },
        [this](int objectPointer) { // action
             // std::cout << "reference count zero. freeing " << objectPointer << " (" << classNameOfObject(fetchClassOf(objectPointer)) << ") free oops = " << freeOops << "\n";
-            countBitsOf_put(objectPointer, 0);
-            freeWords += spaceOccupiedBy(objectPointer); //dbanay
-            freeOops++;
-            deallocate(objectPointer);
+#ifdef HEAP_PROFILING
+            profileRelease(objectPointer, false);
+#endif
+            releaseZeroCountObject(objectPointer);
        });
 
 }
 
 
+// The countDown: action
+void ObjectMemory::releaseZeroCountObject(int objectPointer)
+{
+    countBitsOf_put(objectPointer, 0);
+    freeWords += spaceOccupiedBy(objectPointer); //dbanay
+    freeOops++;
+#ifdef CONTEXT_FREE_LISTS
+    if (toContextFreeListAdd(objectPointer))
+        return;
+#endif
+    deallocate(objectPointer);
+}
+
+
 // countUp:
 int ObjectMemory::countUp(int objectPointer)
 {
@@ -1289,8 +2389,59 @@ int ObjectMemory::forAllOtherObjectsAccessibleFrom_suchThat_do(
     return objectPointer;
 }
 #else
+#ifdef EXPLICIT_MARK_STACK
+// forAllOtherObjectsAccessibleFrom:suchThat:do:
+int ObjectMemory::forAllOtherObjectsAccessibleFrom_suchThat_do(
+  int objectPointer,
+  const std::function <bool (int)>& predicate,
+  const std::function <void (int)>& action
+)
+{
+    // Frames below base belong to a traversal further up the C++ stack
+    int base = traversalStackCount;
+    int next;
+    
+    // Same order as G&R: the fields from last to first, then the class
+    traversalStack[traversalStackCount++] = { objectPointer, lastPointerOf(objectPointer) };
+    while (traversalStackCount > base)
+    {
+        TraversalFrame &frame = traversalStack[traversalStackCount - 1];
+        if (--frame.offset > 0)
+        {
+            next = heapChunkOf_word(frame.objectPointer, frame.offset);
+            if (!isIntegerObject(next) && predicate(next))
+            {
+                if (traversalStackCount < TraversalStackSize)
+                {
+                    std::uint16_t *fields = fieldAddressOf(next);
+                    __builtin_prefetch(fields);
+                    traversalStack[traversalStackCount++] = { next, lastPointerOf(next) };
+                }
+                else
+                {
+                    traversalOverflows++;
+                    reversingForAllOtherObjectsAccessibleFrom_suchThat_do(next, predicate, action);
+                }
+            }
+        }
+        else
+        {
+            // all pointers have been followed; now perform the action
+            int current = frame.objectPointer;
+            traversalStackCount--;
+            action(current);
+        }
+    }
+    return objectPointer;
+}
+
+
+// G&R forAllOtherObjectsAccessibleFrom:suchThat:do:
+int ObjectMemory::reversingForAllOtherObjectsAccessibleFrom_suchThat_do(
+#else
 // forAllOtherObjectsAccessibleFrom:suchThat:do:
 int ObjectMemory::forAllOtherObjectsAccessibleFrom_suchThat_do(
+#endif
   int objectPointer,
   const std::function <bool (int)>& predicate,
   const std::function <void (int)>& action
@@ -1440,6 +2591,19 @@ int ObjectMemory::storePointer_ofObject_withValue(int fieldIndex, int objectPoin
  // CLogger::Get ()->Write ("objmemory", LogDebug, "storePointer_ofObject_withValue 2");
     chunkIndex = HeaderSize + fieldIndex;
     
+#ifdef GC_DEFERRED_REF_COUNT
+    if (isUncountedField(fieldIndex, objectPointer))
+    {
+        deferredStores++;
+        return heapChunkOf_word_put(objectPointer, chunkIndex, valuePointer);
+    }
+    countedStores++;
+#endif
+#ifdef GC_INCREMENTAL
+    // write barrier
+    if (incrementalPhase == IncrementalMarking)
+        grayObject(valuePointer);
+#endif
 #ifdef GC_REF_COUNT
     countUp(valuePointer);
  // CLogger::Get ()->Write ("objmemory", LogDebug, "storePointer_ofObject_withValue 3");
@@ -1482,7 +2646,7 @@ int ObjectMemory::initialInstanceOf(int classPointer)
     for(int pointer = 0; pointer <= ObjectTableSize-2; pointer += 2)
     {
         // Only consider non-free entries that are not free chunks
-        if (freeBitOf(pointer) == 0 && countBitsOf(pointer) != 0)
+        if (hasObject(pointer))
         {
             if (fetchClassOf(pointer) == classPointer)
                 return pointer;
@@ -1535,6 +2699,57 @@ void ObjectMemory::swapPointersOf_and(int firstPointer, int secondPointer)
     locationBitsOf_put(secondPointer, firstLocation);
     pointerBitOf_put(secondPointer, firstPointerBit);
     oddBitOf_put(secondPointer, firstOdd);
+#ifdef GC_INCREMENTAL
+    // A body that was already scanned may have moved to an unscanned oop
+    if (incrementalPhase == IncrementalMarking)
+    {
+        clearBit(markBits, firstPointer);
+        clearBit(markBits, secondPointer);
+        grayObject(firstPointer);
+        grayObject(secondPointer);
+    }
+#endif
+#ifdef DELTA_SNAPSHOTS
+    // Each oop has the other body now, which need not be on a dirty page
+    setBit(changedObjects, firstPointer);
+    setBit(changedObjects, secondPointer);
+#endif
+}
+
+
+bool ObjectMemory::swapPointersOfElementsOf_and(int firstArray, int secondArray)
+{
+    int length = fetchWordLengthOf(firstArray);
+    bool valid = length == fetchWordLengthOf(secondArray) && firstArray != secondArray;
+    
+    // Validate all pairs before the first swap
+    memset(selectionBits, 0, sizeof(selectionBits));
+    setBit(selectionBits, firstArray);
+    setBit(selectionBits, secondArray);
+    for(int i = 0; valid && i < length; i++)
+    {
+        int firstPointer = fetchPointer_ofObject(i, firstArray);
+        int secondPointer = fetchPointer_ofObject(i, secondArray);
+        
+        if (isIntegerObject(firstPointer) || isIntegerObject(secondPointer) ||
+            testBit(selectionBits, firstPointer) || testBit(selectionBits, secondPointer) ||
+            firstPointer == secondPointer)
+            valid = false;
+        else
+        {
+            setBit(selectionBits, firstPointer);
+            setBit(selectionBits, secondPointer);
+        }
+    }
+    if (!valid)
+        return false;
+    
+    // The reference counts stay with the oops, no reference changes
+    for(int i = 0; i < length; i++)
+    {
+        swapPointersOf_and(fetchPointer_ofObject(i, firstArray), fetchPointer_ofObject(i, secondArray));
+    }
+    return true;
 }
 
 
@@ -1576,6 +2791,11 @@ bool ObjectMemory::hasObject(int objectPointer)
    		and: [(self countBitsOf: objectPointer) ~= 0]
    */
     cantBeIntegerObject(objectPointer); // dbanay
+#ifdef GC_DEFERRED_REF_COUNT
+    // zero count objects referred to by the stack are in the zero count table
+    if (freeBitOf(objectPointer) == 0 && testBit(zeroCountBits, objectPointer))
+        return true;
+#endif
     return freeBitOf(objectPointer) == 0 && countBitsOf(objectPointer) != 0;
 }
 
@@ -1607,10 +2827,285 @@ int ObjectMemory::instantiateClass_withPointers(int classPointer, int length)
     
     size = HeaderSize + length;
     extra = size < HugeSize ? 0 : 1;
+#ifdef CONTEXT_FREE_LISTS
+    if (classPointer == ClassMethodContextPointer || classPointer == ClassBlockContextPointer)
+    {
+        int context;
+        
+        contextAllocations++;
+        context = removeFromContextFreeList(classPointer, length);
+        if (context != NilPointer)
+        {
+#ifdef HEAP_PROFILING
+            profileAllocation(classPointer);
+#endif
+            return context;
+        }
+    }
+#endif
     return allocate_odd_pointer_extra_class(size, 0, 1, extra, classPointer);
 }
 
 
+#ifdef HEAP_PROFILING
+
+void ObjectMemory::resetHeapProfile()
+{
+    memset(classProfiles, 0, sizeof(classProfiles));
+    heapProfileStart = hal->get_msclock();
+}
+
+
+void ObjectMemory::heapProfile(const std::function <void (int, const ClassProfile&)>& action)
+{
+    for(int index = 0; index < ObjectTableSize / 2; index++)
+    {
+        classProfiles[index].instances = 0;
+        classProfiles[index].words = 0;
+    }
+    
+    // Free chunks and the kept contexts have a zero count
+    for(int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+    {
+        if (!hasObject(objectPointer))
+            continue;
+        ClassProfile &profile = classProfiles[classBitsOf(objectPointer) >> 1];
+        profile.instances++;
+        profile.words += spaceOccupiedBy(objectPointer);
+    }
+    
+    for(int index = 0; index < ObjectTableSize / 2; index++)
+    {
+        const ClassProfile &profile = classProfiles[index];
+        if (profile.instances != 0 || profile.allocations != 0 ||
+            profile.countFrees != 0 || profile.collectionFrees != 0)
+            action(index << 1, profile);
+    }
+}
+
+#endif
+
+#ifdef CONTEXT_FREE_LISTS
+
+void ObjectMemory::resetContextFreeLists()
+{
+    contextFreeListCount[0] = contextFreeListCount[1] = 0;
+}
+
+
+bool ObjectMemory::toContextFreeListAdd(int objectPointer)
+{
+    int classPointer = classBitsOf(objectPointer);
+    int index;
+    
+    if (classPointer != ClassMethodContextPointer && classPointer != ClassBlockContextPointer)
+        return false;
+    
+    index = contextFreeListIndex(fetchWordLengthOf(objectPointer));
+    if (index < 0 || contextFreeListCount[index] == ContextFreeListDepth)
+        return false;
+    
+    // The fields were already counted down by countDown and are
+    // overwritten when the context is handed out again
+    contextFreeList[index][contextFreeListCount[index]++] = objectPointer;
+    contextReleases++;
+    return true;
+}
+
+
+int ObjectMemory::removeFromContextFreeList(int classPointer, int length)
+{
+    int index = contextFreeListIndex(length);
+    int objectPointer;
+    int size;
+    std::uint16_t *fields;
+    
+    if (index < 0 || contextFreeListCount[index] == 0)
+        return NilPointer;
+    
+    objectPointer = contextFreeList[index][--contextFreeListCount[index]];
+    
+    // Same as allocate:odd:pointer:extra:class: minus the chunk search
+    // (the old class was counted down with the fields)
+    countUp(classPointer);
+    classBitsOf_put(objectPointer, classPointer);
+    fields = fieldAddressOf(objectPointer);
+    for (int i = 0; i < length; i++)
+        fields[i] = NilPointer;
+    
+    size = HeaderSize + length;
+    freeOops--;
+    if (freeWords >= size)
+        freeWords -= size;
+#ifdef GC_INCREMENTAL
+    allocatedDuringCycle(objectPointer);
+#endif
+#ifdef GC_DEFERRED_REF_COUNT
+    toZeroCountTableAdd(objectPointer);
+#endif
+    contextRecycles++;
+    return objectPointer;
+}
+
+#endif
+
+
+#ifdef GC_DEFERRED_REF_COUNT
+
+void ObjectMemory::toZeroCountTableAdd(int objectPointer)
+{
+    if (testBit(zeroCountBits, objectPointer))
+        return;
+    if (zeroCountTableCount == ZeroCountTableSize)
+    {
+        // Left to the next garbage collection
+        zeroCountTableOverflowed = true;
+        return;
+    }
+    setBit(zeroCountBits, objectPointer);
+    zeroCountTable[zeroCountTableCount++] = objectPointer;
+}
+
+
+void ObjectMemory::resetZeroCountTable()
+{
+    for (int i = 0; i < zeroCountTableCount; i++)
+        clearBit(zeroCountBits, zeroCountTable[i]);
+    zeroCountTableCount = 0;
+    zeroCountTableOverflowed = false;
+}
+
+
+void ObjectMemory::clearContextFields(int contextPointer)
+{
+    int length = fetchWordLengthOf(contextPointer);
+    std::uint16_t *fields = fieldAddressOf(contextPointer);
+    
+    for (int i = ContextTempFrameStart; i < length; i++)
+        fields[i] = NilPointer;
+}
+
+
+void ObjectMemory::adjustCountsFromContextFields(int delta)
+{
+    for (int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+    {
+        // A free chunk keeps the free chunk list link in the class field,
+        // which is never a context class
+        if (freeBitOf(objectPointer) != 0 || !isContext(objectPointer))
+            continue;
+        
+        int length = fetchWordLengthOf(objectPointer);
+        for (int i = ContextTempFrameStart; i < length; i++)
+        {
+            int fieldPointer = fetchPointer_ofObject(i, objectPointer);
+            if (isIntegerObject(fieldPointer) || freeBitOf(fieldPointer) != 0)
+                continue;
+            
+            int count = countBitsOf(fieldPointer);
+            if (count >= 128) // sticky, see countUp:
+                continue;
+            count = std::max(0, std::min(127, count + delta));
+            countBitsOf_put(fieldPointer, count);
+            if (count == 0)
+                toZeroCountTableAdd(fieldPointer);
+        }
+    }
+}
+
+
+void ObjectMemory::rebuildZeroCountTable()
+{
+    for (int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+    {
+        // Survivors with a zero count are referred to from contexts (or the
+        // interpreter registers), the other zero counts are free chunks
+        if (freeBitOf(objectPointer) == 0 && countBitsOf(objectPointer) == 0 &&
+            testBit(contextReferencedBits, objectPointer))
+            toZeroCountTableAdd(objectPointer);
+    }
+}
+
+
+void ObjectMemory::reconcileZeroCountTable()
+{
+    std::uint32_t startTime = hal->get_msclock();
+    int kept = 0;
+    
+    // Everything a context field refers to, garbage contexts included. Fields
+    // above the stack pointer are stale but only keep objects a little longer.
+    memset(contextReferencedBits, 0, sizeof(contextReferencedBits));
+    for (int objectPointer = 0; objectPointer <= ObjectTableSize-2; objectPointer += 2)
+    {
+        if (freeBitOf(objectPointer) != 0 || !isContext(objectPointer))
+            continue;
+        
+        int length = fetchWordLengthOf(objectPointer);
+        for (int i = ContextTempFrameStart; i < length; i++)
+        {
+            int fieldPointer = fetchPointer_ofObject(i, objectPointer);
+            if (!isIntegerObject(fieldPointer))
+                setBit(contextReferencedBits, fieldPointer);
+        }
+    }
+    
+    for (int i = 0; i < zeroCountTableCount; i++)
+    {
+        int objectPointer = zeroCountTable[i];
+        
+        if (!testBit(zeroCountBits, objectPointer))
+            continue;
+        clearBit(zeroCountBits, objectPointer);
+        if (freeBitOf(objectPointer) != 0 || countBitsOf(objectPointer) != 0)
+            continue; // freed by a collection or referenced again
+        if (testBit(contextReferencedBits, objectPointer))
+        {
+            setBit(zeroCountBits, objectPointer);
+            zeroCountTable[kept++] = objectPointer;
+            continue;
+        }
+        
+        // Same as countDown: on an object whose count reached zero, except
+        // that objects referred to by a context go back into the table
+        if (isContext(objectPointer))
+            clearContextFields(objectPointer);
+        forAllOtherObjectsAccessibleFrom_suchThat_do(objectPointer,
+           [this](int objectPointer) { // predicate
+                int count = countBitsOf(objectPointer) - 1;
+                RUNTIME_CHECK(count >= 0);
+                if (count < 127)
+                    countBitsOf_put(objectPointer, count);
+                if (count != 0)
+                    return false;
+                if (testBit(contextReferencedBits, objectPointer))
+                {
+                    // appended, and kept when the loop gets to it
+                    toZeroCountTableAdd(objectPointer);
+                    return false;
+                }
+                clearBit(zeroCountBits, objectPointer);
+                if (isContext(objectPointer))
+                    clearContextFields(objectPointer);
+                return true;
+           },
+           [this](int objectPointer) { // action
+#ifdef HEAP_PROFILING
+                profileRelease(objectPointer, false);
+#endif
+                releaseZeroCountObject(objectPointer);
+                reconcileFreed++;
+           });
+    }
+    
+    zeroCountTableCount = kept;
+    zeroCountTableOverflowed = false;
+    reconcileCount++;
+    reconcileTime += hal->get_msclock() - startTime;
+}
+
+#endif
+
+
 // instanceAfter:
 int ObjectMemory::instanceAfter(int objectPointer)
 {
@@ -1645,6 +3140,67 @@ int ObjectMemory::instanceAfter(int objectPointer)
 }
 
 
+int ObjectMemory::forAllInstancesOf_count_do(const int *classes, int classCount, bool allObjects,
+                                             const std::function <void (int)>& action)
+{
+    int count = 0;
+    
+    memset(selectionBits, 0, sizeof(selectionBits));
+    for(int i = 0; i < classCount; i++)
+    {
+        setBit(selectionBits, classes[i]);
+    }
+    
+    for(int pointer = 0; pointer <= ObjectTableSize-2; pointer += 2)
+    {
+        if (hasObject(pointer) &&
+            (allObjects || testBit(selectionBits, classBitsOf(pointer))))
+        {
+            action(pointer);
+            count++;
+        }
+    }
+    return count;
+}
+
+int ObjectMemory::forAllObjectsReferringTo_count_do(const int *targets, int targetCount,
+                                                    const std::function <void (int)>& action)
+{
+    int count = 0;
+    
+    memset(selectionBits, 0, sizeof(selectionBits));
+    for(int i = 0; i < targetCount; i++)
+    {
+        setBit(selectionBits, targets[i]);
+    }
+    
+    for(int pointer = 0; pointer <= ObjectTableSize-2; pointer += 2)
+    {
+        if (!hasObject(pointer))
+            continue;
+        
+        int limit = lastPointerOf(pointer);
+        if (isContext(pointer))
+        {
+            // Nothing above the stack pointer is a reference
+            int stackPointer = heapChunkOf_word(pointer, HeaderSize + ContextStackPointerIndex);
+            if (isIntegerObject(stackPointer))
+                limit = std::min(limit, HeaderSize + ContextTempFrameStart + integerValueOf(stackPointer));
+        }
+        for(int offset = 1; offset < limit; offset++)
+        {
+            int fieldPointer = heapChunkOf_word(pointer, offset);
+            if (!isIntegerObject(fieldPointer) && testBit(selectionBits, fieldPointer))
+            {
+                action(pointer);
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
 
 // cantBeIntegerObject:
 void ObjectMemory::cantBeIntegerObject(int objectPointer)
@@ -1711,6 +3267,24 @@ int ObjectMemory::attemptToAllocateChunk(int size)
     RUNTIME_CHECK(currentSegment >= FirstHeapSegment && currentSegment <= LastHeapSegment);
     objectPointer = attemptToAllocateChunkInCurrentSegment(size);
     if (objectPointer != NilPointer) return objectPointer;
+#ifdef SEGREGATED_FIT_ALLOCATION
+    // Any segment with a fitting chunk, then compact them all and try again
+    for(int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+            compactAllSegments();
+        for(int i = 1; i <= HeapSegmentCount; i++)
+        {
+            currentSegment++;
+            if (currentSegment > LastHeapSegment)
+                currentSegment = FirstHeapSegment;
+            objectPointer = attemptToAllocateChunkInCurrentSegment(size);
+            if (objectPointer != NilPointer)
+                return objectPointer;
+        }
+    }
+    return NilPointer;
+#endif
     for(int i = 1; i <= HeapSegmentCount; i++)
     {
         currentSegment++;
@@ -1790,6 +3364,41 @@ int ObjectMemory::attemptToAllocateChunkInCurrentSegment(int size)
     predecessor = NonPointer; // remember predecessor of chunk under consideration
     objectPointer = headOfFreeChunkList_inSegment(BigSize, currentSegment);
     
+#ifdef SEGREGATED_FIT_ALLOCATION
+    // Best fit: an exact fit, or else split the chunk with the least excess
+    int bestPointer = NonPointer;
+    int bestExcess = 0;
+    while (objectPointer != NonPointer)
+    {
+        availableSize = sizeBitsOf(objectPointer);
+        next = classBitsOf(objectPointer);
+        if (availableSize == size)
+        {
+            if (predecessor == NonPointer)
+                headOfFreeChunkList_inSegment_put(BigSize, currentSegment, next);
+            else
+                classBitsOf_put(predecessor, next);
+            return objectPointer;
+        }
+        excessSize = availableSize - size;
+        if (excessSize >= HeaderSize && (bestPointer == NonPointer || excessSize < bestExcess))
+        {
+            bestPointer = objectPointer;
+            bestExcess = excessSize;
+        }
+        predecessor = objectPointer;
+        objectPointer = next;
+    }
+    if (bestPointer == NonPointer)
+        return NilPointer;
+    // the first part remains on the free list
+    newPointer = obtainPointer_location(size, locationBitsOf(bestPointer) + bestExcess);
+    if (newPointer == NilPointer)
+        return NilPointer;
+    sizeBitsOf_put(bestPointer, bestExcess);
+    return newPointer;
+#endif
+    
     // the search loop stops when the end of the linked list is encountered
     while (objectPointer != NonPointer)
     {
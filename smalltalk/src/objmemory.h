@@ -58,11 +58,91 @@
 #define GC_REF_COUNT // FIXME
 
 
+// Contexts freed by reference counting go onto free lists of their own
+// (one for each of the two context sizes) and are handed out again by
+// instantiateClass:withPointers: without going through the free chunk lists
+// and the free pointer list
+#define CONTEXT_FREE_LISTS
+
+#ifndef GC_REF_COUNT
+#undef CONTEXT_FREE_LISTS
+#endif
+
+// Deferred reference counting (Deutsch & Bobrow). Stores into the temporary
+// and stack fields of contexts are not counted. Objects whose count drops to
+// zero go into a zero count table instead of being freed, and the table is
+// reconciled at safe points chosen by the interpreter: entries no context
+// field refers to are freed then. Needs the mark and sweep collector for
+// cycles and for objects that did not fit into the table.
+//#define GC_DEFERRED_REF_COUNT
+
+#if !defined(GC_REF_COUNT) || !defined(GC_MARK_SWEEP)
+#undef GC_DEFERRED_REF_COUNT
+#endif
+
+// Incremental mark and sweep for the cyclic garbage reference counting
+// leaves behind. Marks go into a bit table, gray objects onto an explicit
+// stack, and storePointer:ofObject:withValue: is the write barrier. Marking
+// and sweeping run in slices of bounded length that the VM schedules between
+// frames (incrementalCollectionStep). Sweeping counts down the live objects
+// garbage refers to, so counts stay valid. The stop-the-world collector
+// remains for running out of memory.
+#define GC_INCREMENTAL
+
+#if !defined(GC_REF_COUNT) || !defined(GC_MARK_SWEEP) || defined(GC_DEFERRED_REF_COUNT)
+#undef GC_INCREMENTAL
+#endif
+
 // Define to use recursive marking for ref counting/GC
 // If undefined the stack space efficient pointer reversal approach described
 // on page 678 of G&R is used. Not recommended, and only included for completeness.
 //#define RECURSIVE_MARKING
 
+// Traverse objects for marking and countDown: with an explicit stack of
+// (object, field offset) frames instead of reversing pointers, which writes
+// every object twice. Only a subtree that does not fit onto the stack is
+// traversed by pointer reversal.
+#define EXPLICIT_MARK_STACK
+
+#ifdef RECURSIVE_MARKING
+#undef EXPLICIT_MARK_STACK
+#endif
+
+// Keep the object table as an array of native structs (count, flags and the
+// address of the heap chunk) instead of the two words per entry of G&R in the
+// last segment. Object table words are only composed and taken apart by ot:
+// and ot:put: when a snapshot is loaded or saved; fetches and stores load the
+// chunk address and index it.
+#define NATIVE_OBJECT_TABLE
+
+#if defined(EXTENDED_OBJECT_MEMORY) && !defined(NATIVE_OBJECT_TABLE)
+#error "EXTENDED_OBJECT_MEMORY needs NATIVE_OBJECT_TABLE"
+#endif
+
+// Exact size free chunk lists up to 64 words (both context sizes included),
+// best fit instead of first fit for larger chunks, and allocation from any
+// segment with room before compacting. Compaction then handles all segments
+// at once: one pass over the object table collects the objects above the
+// first free chunk of each segment, sorted by address they slide down. G&R
+// reverse heap pointers instead, with a pass over the object table for
+// every segment compacted.
+#define SEGREGATED_FIT_ALLOCATION
+
+// Count allocations and deallocations per class, the latter separately for
+// reference counting and garbage collection (see primitiveHeapProfile)
+//#define HEAP_PROFILING
+
+// Save snapshots compressed (LZ4 style). They load faster, especially from
+// slow SD cards, but only with this virtual machine. Compressed snapshots
+// are always recognized when loading.
+//#define COMPRESSED_SNAPSHOTS
+
+// Save only what changed since the snapshot was loaded or last saved in full
+// (primitiveDeltaSnapshot). Stores mark the heap page they write into, the
+// changed objects and object table entries go into name.delta, which is
+// merged with the snapshot when it is loaded.
+#define DELTA_SNAPSHOTS
+
 // Perform range checks etc. at runtime
 #define RUNTIME_CHECKING
 
@@ -98,6 +178,21 @@ public:
     bool loadSnapshot(IFileSystem *fileSystem, const char *imageFileName);
     bool saveSnapshot(IFileSystem *fileSystem, const char *imageFileName);
         
+#ifdef DELTA_SNAPSHOTS
+    // Write the objects and object table entries that differ from the base
+    // snapshot, false if the base is not known or the objects do not fit
+    bool saveDeltaSnapshot(IFileSystem *fileSystem, const char *imageFileName);
+    
+    // For heap words written through fieldAddressOf
+    inline void markDirty(const void *address, int bytes)
+    {
+        int first = (int) ((const std::uint8_t *) address - (const std::uint8_t *) heapBase) >> (DirtyPageShift + 1);
+        int last = (int) ((const std::uint8_t *) address + bytes - 1 - (const std::uint8_t *) heapBase) >> (DirtyPageShift + 1);
+        for (int page = first; page <= last; page++)
+            dirtyPages[page >> 5] |= 1u << (page & 31);
+    }
+#endif
+    
     
     // --- BCIInterface ---
 
@@ -114,6 +209,52 @@ public:
 
     void garbageCollect();
     
+#ifdef GC_INCREMENTAL
+    // Run the incremental collector for at most maxMilliseconds. A new cycle
+    // is started once enough oops or words were used since the last one.
+    void incrementalCollectionStep(std::uint32_t maxMilliseconds);
+    
+    inline std::uint32_t incrementalCycles() { return incrementalCycleCount; }
+    inline std::uint32_t objectsFreedIncrementally() { return incrementalFreed; }
+#endif
+    
+#ifdef HEAP_PROFILING
+    struct ClassProfile
+    {
+        std::uint32_t allocations;
+        std::uint32_t countFrees;       // freed when the reference count dropped to zero
+        std::uint32_t collectionFrees;  // freed by the garbage collector
+        std::uint32_t instances;        // live instances, see heapProfile
+        std::uint32_t words;            // ... and the space they occupy
+    };
+    
+    // Evaluate action for every class with live instances or counted
+    // allocations since the last resetHeapProfile
+    void heapProfile(const std::function <void (int, const ClassProfile&)>& action);
+    void resetHeapProfile();
+    inline std::uint32_t heapProfileMilliseconds() { return hal->get_msclock() - heapProfileStart; }
+#endif
+    
+#ifdef GC_DEFERRED_REF_COUNT
+    // True if the zero count table should be reconciled at the next safe point
+    inline bool zeroCountTableNeedsReconcile()
+    {
+        return zeroCountTableCount >= ZeroCountTableReconcileLimit || zeroCountTableOverflowed;
+    }
+    
+    // Free the zero count objects that no context field refers to. Only to be
+    // called where no oop is held outside of object memory and the
+    // interpreter registers (between bytecodes).
+    void reconcileZeroCountTable();
+    
+    // Deferred reference counting statistics
+    inline std::uint32_t storesDeferred() { return deferredStores; }
+    inline std::uint32_t storesCounted() { return countedStores; }
+    inline std::uint32_t reconciles() { return reconcileCount; }
+    inline std::uint32_t reconcileMilliseconds() { return reconcileTime; }
+    inline std::uint32_t objectsFreedByReconcile() { return reconcileFreed; }
+#endif
+    
     // storePointer:ofObject:withValue:
     int storePointer_ofObject_withValue(int fieldIndex, int objectPointer, int valuePointer);
     
@@ -131,6 +272,14 @@ public:
 #endif
     }
     
+#ifdef GC_REF_COUNT
+    // Current reference count of an object (sticks at 128)
+    inline int referenceCountOf(int objectPointer)
+    {
+        return countBitsOf(objectPointer);
+    }
+#endif
+    
     // initialInstanceOf:
     int initialInstanceOf(int classPointer);
     
@@ -187,6 +336,11 @@ public:
     // swapPointersOf:and:
     void swapPointersOf_and(int firstPointer, int secondPointer);
     
+    // swapPointersOf:and: for the corresponding elements of two Arrays of
+    // the same size. Nothing is swapped if an element is a SmallInteger,
+    // occurs twice or is one of the Arrays.
+    bool swapPointersOfElementsOf_and(int firstArray, int secondArray);
+    
     // fetchWordLengthOf:
     inline int fetchWordLengthOf(int objectPointer)
     {
@@ -220,6 +374,13 @@ public:
     // instantiateClass:withPointers:
     int instantiateClass_withPointers(int classPointer, int length);
     
+#ifdef CONTEXT_FREE_LISTS
+    // Context allocation statistics
+    inline std::uint32_t contextsAllocated() { return contextAllocations; }
+    inline std::uint32_t contextsRecycled() { return contextRecycles; }
+    inline std::uint32_t contextsReleased() { return contextReleases; }
+#endif
+    
     // fetchByte:ofObject:
     inline int fetchByte_ofObject(int byteIndex, int objectPointer)
     {
@@ -229,6 +390,18 @@ public:
         return heapChunkOf_byte(objectPointer, (HeaderSize*2 + byteIndex));
     }
     
+    // Address of the first field of an object. Only valid until the next
+    // allocation, which may compact the heap and move the object.
+    inline std::uint16_t *fieldAddressOf(int objectPointer)
+    {
+#ifdef NATIVE_OBJECT_TABLE
+        return entryOf(objectPointer).address + HeaderSize;
+#else
+        return wordMemory.segment_word_address(segmentBitsOf(objectPointer),
+                locationBitsOf(objectPointer) + HeaderSize);
+#endif
+    }
+    
     // fetchPointer:ofObject:
     inline int fetchPointer_ofObject(int fieldIndex, int objectPointer)
     {
@@ -280,6 +453,18 @@ public:
     // instanceAfter:
     int instanceAfter(int objectPointer);
     
+    // Evaluate action for every object of one of the classes, or for every
+    // object if allObjects is true, in a single pass over the object table.
+    // Answers the number of objects.
+    int forAllInstancesOf_count_do(const int *classes, int classCount, bool allObjects,
+                                   const std::function <void (int)>& action);
+    
+    // Evaluate action for every object with a field (or class) referring to
+    // one of the targets, in a single pass over the object table. Answers
+    // the number of objects.
+    int forAllObjectsReferringTo_count_do(const int *targets, int targetCount,
+                                          const std::function <void (int)>& action);
+    
     // storeByte:ofObject:withValue:
     inline int storeByte_ofObject_withValue(int byteIndex, int objectPointer, int valueByte)
     {
@@ -303,6 +488,13 @@ public:
     #ifdef GC_MARK_SWEEP
         void addRoot(int rootObjectPointer) //dbanay
         {
+    #ifdef GC_INCREMENTAL
+            if (incrementalPhase == IncrementalMarking)
+            {
+                grayObject(rootObjectPointer);
+                return;
+            }
+    #endif
             markObjectsAccessibleFrom(rootObjectPointer);
         }
     #endif
@@ -326,6 +518,11 @@ private:
     // abandonFreeChunksInSegment:
     int abandonFreeChunksInSegment(int segment);
     
+#ifdef SEGREGATED_FIT_ALLOCATION
+    // Compact every heap segment with one pass over the object table
+    void compactAllSegments();
+#endif
+    
     // allocateChunk:
     int allocateChunk(int size);
     
@@ -408,6 +605,9 @@ private:
     // deallocate:
     void deallocate(int objectPointer);
     
+    // The countDown: action, frees an object whose count dropped to zero
+    void releaseZeroCountObject(int objectPointer);
+    
     // forAllOtherObjectsAccessibleFrom:suchThat:do:
     int forAllOtherObjectsAccessibleFrom_suchThat_do(
                                                      int objectPointer,
@@ -419,8 +619,41 @@ private:
     int forAllObjectsAccessibleFrom_suchThat_do(int objectPointer,
                                                 const std::function <bool (int)>& predicate,
                                                 const std::function <void (int)>& action);
+    
+#ifdef EXPLICIT_MARK_STACK
+    // forAllOtherObjectsAccessibleFrom:suchThat:do: of G&R, by pointer reversal
+    int reversingForAllOtherObjectsAccessibleFrom_suchThat_do(
+                                                     int objectPointer,
+                                                     const std::function <bool (int)>& predicate,
+                                                     const std::function <void (int)>& action
+                                                     );
+#endif
 
     
+#ifdef CONTEXT_FREE_LISTS
+    // --- ContextFreeLists ---
+    
+    // Keep a context whose count dropped to zero for reuse, false if it is
+    // not a context of a standard size or the list is full
+    bool toContextFreeListAdd(int objectPointer);
+    
+    // A reinitialized context or NilPointer
+    int removeFromContextFreeList(int classPointer, int length);
+    
+    // Give up the kept contexts (they become ordinary free chunks)
+    void resetContextFreeLists();
+    
+    // 0 for small (12 + TempFrameStart) and 1 for large (32 + TempFrameStart) contexts
+    inline int contextFreeListIndex(int length)
+    {
+        if (length == 12 + ContextTempFrameStart)
+            return 0;
+        if (length == 32 + ContextTempFrameStart)
+            return 1;
+        return -1;
+    }
+#endif
+    
     // --- ObjectTableEnt ---
     
     // segmentBitsOf:
@@ -430,7 +663,11 @@ private:
         ^self ot: objectPointer bits: 12 to: 15
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return wordAddressOf(objectPointer) >> 16;
+#else
         return ot_bits_to(objectPointer, 12, 15);
+#endif
     }
     
     // heapChunkOf:byte:put:
@@ -442,9 +679,21 @@ private:
             byte: (offset\\2) put: value
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        std::uint8_t *address = (std::uint8_t *) entryOf(objectPointer).address + offset;
+#ifdef DELTA_SNAPSHOTS
+        markPageDirty(address);
+#endif
+        return *address = value;
+#else
+#ifdef DELTA_SNAPSHOTS
+        markPageDirty(wordMemory.segment_word_address(segmentBitsOf(objectPointer),
+                locationBitsOf(objectPointer) + (offset/2)));
+#endif
         return wordMemory.segment_word_byte_put(segmentBitsOf(objectPointer),
                 locationBitsOf(objectPointer) + (offset/2),
                 offset % 2, value);
+#endif
     }
 
     
@@ -455,7 +704,11 @@ private:
         ^self ot: objectPointer bits: 9 to: 9 put: value
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return flagOf_put(objectPointer, PointerFlag, value);
+#else
         return ot_bits_to_put(objectPointer, 9, 9, value);
+#endif
     }
 
     
@@ -466,8 +719,12 @@ private:
         ^wordMemory segment: (self segmentBitsOf: objectPointer)
             word: ((self locationBitsOf: objectPointer) + offset)
        */
+#ifdef NATIVE_OBJECT_TABLE
+        return entryOf(objectPointer).address[offset];
+#else
         return wordMemory.segment_word(segmentBitsOf(objectPointer),
                 locationBitsOf(objectPointer) + offset);
+#endif
     }
     
     // segmentBitsOf:put:
@@ -477,7 +734,12 @@ private:
          ^self ot: objectPointer bits: 12 to: 15 put: value
          */
         
+#ifdef NATIVE_OBJECT_TABLE
+        addressOf_put(objectPointer, value, locationBitsOf(objectPointer));
+        return value;
+#else
         return ot_bits_to_put(objectPointer, 12, 15, value);
+#endif
     }
     
     // heapChunkOf:word:put:
@@ -488,9 +750,21 @@ private:
             word: ((self locationBitsOf: objectPointer) + offset)
             put: value
        */
+#ifdef NATIVE_OBJECT_TABLE
+        std::uint16_t *address = entryOf(objectPointer).address + offset;
+#ifdef DELTA_SNAPSHOTS
+        markPageDirty(address);
+#endif
+        return *address = value;
+#else
+#ifdef DELTA_SNAPSHOTS
+        markPageDirty(wordMemory.segment_word_address(segmentBitsOf(objectPointer),
+                locationBitsOf(objectPointer) + offset));
+#endif
         return wordMemory.segment_word_put(segmentBitsOf(objectPointer),
                 locationBitsOf(objectPointer) + offset,
                 value);
+#endif
     }
     
     // oddBitOf:
@@ -500,7 +774,11 @@ private:
          ^self ot: objectPointer bits: 8 to: 8
          */
         
+#ifdef NATIVE_OBJECT_TABLE
+        return (entryOf(objectPointer).flags & OddFlag) != 0;
+#else
         return ot_bits_to(objectPointer, 8, 8);
+#endif
     }
 
     
@@ -511,7 +789,11 @@ private:
         ^self ot: objectPointer bits: 10 to: 10
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return (entryOf(objectPointer).flags & FreeFlag) != 0;
+#else
         return ot_bits_to(objectPointer, 10, 10);
+#endif
     }
     
     // locationBitsOf:
@@ -522,9 +804,13 @@ private:
         ^wordMemory segment: ObjectTableSegment
             word: ObjectTableStart + objectPointer + 1
        */
+#ifdef NATIVE_OBJECT_TABLE
+        return wordAddressOf(objectPointer) & 0xffff;
+#else
         cantBeIntegerObject(objectPointer);
         return wordMemory.segment_word(ObjectTableSegment,
             ObjectTableStart + objectPointer + 1);
+#endif
     }
     
     // ot:
@@ -537,9 +823,15 @@ private:
             word: ObjectTableStart + objectPointer
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        // Only segments 0-15 fit, see EXTENDED_OBJECT_MEMORY
+        ObjectTableEntry &entry = entryOf(objectPointer);
+        return (entry.count << 8) | entry.flags | ((wordAddressOf(objectPointer) >> 16) & 15);
+#else
         cantBeIntegerObject(objectPointer);
         return wordMemory.segment_word(ObjectTableSegment,
             ObjectTableStart + objectPointer);
+#endif
     }
     
     // freeBitOf:put:
@@ -549,7 +841,11 @@ private:
         ^self ot: objectPointer bits: 10 to: 10 put: value
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return flagOf_put(objectPointer, FreeFlag, value);
+#else
         return ot_bits_to_put(objectPointer, 10, 10, value);
+#endif
     }
     
     // classBitsOf:put:
@@ -571,9 +867,13 @@ private:
             byte: (offset\\2)
        */
 
+#ifdef NATIVE_OBJECT_TABLE
+        return ((std::uint8_t *) entryOf(objectPointer).address)[offset];
+#else
         return wordMemory.segment_word_byte(segmentBitsOf(objectPointer),
                         locationBitsOf(objectPointer) + offset/2,
                         offset % 2);
+#endif
     }
 
     
@@ -586,10 +886,15 @@ private:
             word: ObjectTableStart + objectPointer + 1
             put: value
        */
+#ifdef NATIVE_OBJECT_TABLE
+        addressOf_put(objectPointer, segmentBitsOf(objectPointer), value);
+        return value;
+#else
         cantBeIntegerObject(objectPointer);
         return wordMemory.segment_word_put(ObjectTableSegment,
             ObjectTableStart + objectPointer + 1,
             value);
+#endif
     }
 
     
@@ -610,7 +915,11 @@ private:
        /* "source"
         ^self ot: objectPointer bits: 8 to: 8 put: value
        */
+#ifdef NATIVE_OBJECT_TABLE
+        return flagOf_put(objectPointer, OddFlag, value);
+#else
        return ot_bits_to_put(objectPointer, 8, 8, value);
+#endif
     }
     
     // ot:put:
@@ -623,10 +932,18 @@ private:
             put: value
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        ObjectTableEntry &entry = entryOf(objectPointer);
+        entry.count = value >> 8;
+        entry.flags = value & (OddFlag | PointerFlag | FreeFlag);
+        addressOf_put(objectPointer, value & 15, locationBitsOf(objectPointer));
+        return value;
+#else
         cantBeIntegerObject(objectPointer);
         return wordMemory.segment_word_put(ObjectTableSegment,
                 ObjectTableStart + objectPointer,
                 value);
+#endif
     }
 
     // countBitsOf:put:
@@ -636,7 +953,11 @@ private:
         ^self ot: objectPointer bits: 0 to: 7 put: value
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return entryOf(objectPointer).count = value;
+#else
       return ot_bits_to_put(objectPointer, 0, 7, value);
+#endif
     }
     
     // classBitsOf:
@@ -656,7 +977,11 @@ private:
         ^self ot: objectPointer bits: 0 to: 7
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return entryOf(objectPointer).count;
+#else
         return ot_bits_to(objectPointer, 0, 7);
+#endif
     }
     
     // ot:bits:to:put:
@@ -676,12 +1001,18 @@ private:
             put: value
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        int mask = ((1 << (lastBitIndex - firstBitIndex + 1)) - 1) << (15 - lastBitIndex);
+        ot_put(objectPointer, (ot(objectPointer) & ~mask) | (value << (15 - lastBitIndex)));
+        return value;
+#else
         cantBeIntegerObject(objectPointer);
         return wordMemory.segment_word_bits_to_put(ObjectTableSegment,
                     ObjectTableStart + objectPointer,
                     firstBitIndex,
                     lastBitIndex,
                     value);
+#endif
     }
     
     // sizeBitsOf:put:
@@ -705,10 +1036,14 @@ private:
             to: lastBitIndex
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return (ot(objectPointer) >> (15 - lastBitIndex)) & ((1 << (lastBitIndex - firstBitIndex + 1)) - 1);
+#else
         cantBeIntegerObject(objectPointer);
         return wordMemory.segment_word_bits_to(ObjectTableSegment,
                  ObjectTableStart + objectPointer,
                  firstBitIndex, lastBitIndex);
+#endif
 
     }
     
@@ -719,7 +1054,11 @@ private:
         ^self ot: objectPointer bits: 9 to: 9
        */
        
+#ifdef NATIVE_OBJECT_TABLE
+        return (entryOf(objectPointer).flags & PointerFlag) != 0;
+#else
         return ot_bits_to(objectPointer, 9, 9);
+#endif
     }
 
     
@@ -788,11 +1127,57 @@ private:
     
     // The location of the head of the linked list of free object table entries
     static const int FreePointerList = ObjectTableStart + ObjectTableSize; // G&R pg. 664
+    
+#ifdef NATIVE_OBJECT_TABLE
+    // An object table entry. The flags are the bits of the low byte of ot:
+    // (the segment is part of the address). The free pointer list head
+    // stays at FreePointerList, the words in front of it are unused.
+    struct ObjectTableEntry
+    {
+        std::uint16_t *address; // segment and location
+        std::uint8_t count;
+        std::uint8_t flags;
+    };
+    
+    static const int OddFlag = 0x80;        // bit 8
+    static const int PointerFlag = 0x40;    // bit 9
+    static const int FreeFlag = 0x20;       // bit 10
+    
+    ObjectTableEntry objectTable[ObjectTableSize / 2];
+    
+    inline ObjectTableEntry &entryOf(int objectPointer)
+    {
+        cantBeIntegerObject(objectPointer);
+        return objectTable[objectPointer >> 1];
+    }
+    
+    // Segment and location as one 20-bit word address
+    inline int wordAddressOf(int objectPointer)
+    {
+        return (int) (entryOf(objectPointer).address - wordMemory.segment_word_address(0, 0));
+    }
+    
+    inline void addressOf_put(int objectPointer, int segment, int location)
+    {
+        entryOf(objectPointer).address = wordMemory.segment_word_address(segment, location);
+    }
+    
+    inline int flagOf_put(int objectPointer, int flag, int value)
+    {
+        ObjectTableEntry &entry = entryOf(objectPointer);
+        entry.flags = value ? entry.flags | flag : entry.flags & ~flag;
+        return value;
+    }
+#endif
 
     // G&R pg. 664 - Object Table Related Constants
     // The smallest size of chunk that is not stored on a list whose chunk share the same size.
     // (Theindex of the last free chunk list).
+#ifdef SEGREGATED_FIT_ALLOCATION
+    static const int BigSize = 64;
+#else
     static const int BigSize = 20;
+#endif
     static const int FirstFreeChunkListSize = BigSize+1;
 
     
@@ -849,10 +1234,252 @@ private:
     // Object space starts at offset 512 in the image
     static const int ObjectSpaceBaseInImage = 512;
 
+    // Fields preceding the temporaries of a context (see Interpreter)
+    static const int ContextTempFrameStart = 6;
+    static const int ContextStackPointerIndex = 2;
+    
+    inline bool isContext(int objectPointer)
+    {
+        int classPointer = classBitsOf(objectPointer);
+        return classPointer == ClassMethodContextPointer || classPointer == ClassBlockContextPointer;
+    }
+    
+#ifdef CONTEXT_FREE_LISTS
+    static const int ContextFreeListDepth = 64;
+    
+    // Kept separate from the free chunk lists since the class field,
+    // which links free chunks, is left intact for the sweep in compaction
+    int contextFreeList[2][ContextFreeListDepth];
+    int contextFreeListCount[2];
+    
+    std::uint32_t contextAllocations; // contexts instantiated
+    std::uint32_t contextRecycles;    // ... of which came from the context free lists
+    std::uint32_t contextReleases;    // contexts put on the context free lists
+#endif
+    
+    // Bit tables with one bit per object table entry
+    inline bool testBit(const std::uint32_t *bits, int objectPointer)
+    {
+        return (bits[objectPointer >> 6] >> ((objectPointer >> 1) & 31)) & 1;
+    }
+    
+    inline void setBit(std::uint32_t *bits, int objectPointer)
+    {
+        bits[objectPointer >> 6] |= 1u << ((objectPointer >> 1) & 31);
+    }
+    
+    inline void clearBit(std::uint32_t *bits, int objectPointer)
+    {
+        bits[objectPointer >> 6] &= ~(1u << ((objectPointer >> 1) & 31));
+    }
+    
+#ifdef GC_DEFERRED_REF_COUNT
+    static const int ZeroCountTableSize = 2048;
+    static const int ZeroCountTableReconcileLimit = ZeroCountTableSize * 3 / 4;
+    
+    // Objects with a zero count that may still be referred to by a context.
+    // Membership is kept in a bit table (one bit per oop) so an object is
+    // entered only once; an object that does not fit is left to the next
+    // garbage collection.
+    int zeroCountTable[ZeroCountTableSize];
+    int zeroCountTableCount;
+    bool zeroCountTableOverflowed;
+    std::uint32_t zeroCountBits[ObjectTableSize / 64 + 1];
+    
+    // Objects referred to by a context field, set up by reconcileZeroCountTable
+    // (and the survivors of a collection while rectifying counts)
+    std::uint32_t contextReferencedBits[ObjectTableSize / 64 + 1];
+    
+    std::uint32_t deferredStores;   // context field stores that were not counted
+    std::uint32_t countedStores;    // ... and all other pointer stores
+    std::uint32_t reconcileCount;
+    std::uint32_t reconcileTime;    // milliseconds spent reconciling
+    std::uint32_t reconcileFreed;   // objects freed by reconciling
+    
+    // A temporary or stack field of a context, which is not counted
+    inline bool isUncountedField(int fieldIndex, int objectPointer)
+    {
+        return fieldIndex >= ContextTempFrameStart && isContext(objectPointer);
+    }
+    
+    void toZeroCountTableAdd(int objectPointer);
+    void resetZeroCountTable();
+    
+    // Nil the uncounted fields of a context about to be freed
+    void clearContextFields(int contextPointer);
+    
+    // Add delta to the counts of everything context fields refer to, which
+    // converts between deferred and ordinary counts (snapshots)
+    void adjustCountsFromContextFields(int delta);
+    
+    // Enter the zero count objects the last collection left alive
+    void rebuildZeroCountTable();
+#endif
+    
+#ifdef HEAP_PROFILING
+    // Indexed by class oop/2
+    ClassProfile classProfiles[ObjectTableSize / 2];
+    std::uint32_t heapProfileStart;
+    
+    inline void profileAllocation(int classPointer)
+    {
+        classProfiles[classPointer >> 1].allocations++;
+    }
+    
+    // Before the class field is reused for the free chunk link
+    inline void profileRelease(int objectPointer, bool collected)
+    {
+        int classPointer = classBitsOf(objectPointer);
+        if (isIntegerObject(classPointer) || classPointer >= ObjectTableSize)
+            return; // not an object
+        ClassProfile &profile = classProfiles[classPointer >> 1];
+        if (collected)
+            profile.collectionFrees++;
+        else
+            profile.countFrees++;
+    }
+#endif
+    
+    // Oops seen by swapPointersOfElementsOf_and, classes for forAllInstancesOf_count_do,
+    // free chunks and kept contexts during reclaimInaccessibleObjects (HEAP_PROFILING)
+    std::uint32_t selectionBits[ObjectTableSize / 64 + 1];
+    
+#ifdef EXPLICIT_MARK_STACK
+    struct TraversalFrame
+    {
+        int objectPointer;
+        int offset;     // of the field looked at last, counts down to the class
+    };
+    
+    static const int TraversalStackSize = 16384;
+    
+    TraversalFrame traversalStack[TraversalStackSize];
+    int traversalStackCount;
+    std::uint32_t traversalOverflows;
+#endif
+    
+#ifdef SEGREGATED_FIT_ALLOCATION
+    // Segment, location and oop of the objects to move, see compactAllSegments
+    std::uint64_t compactionOrder[ObjectTableSize / 2];
+#endif
+    
+#ifdef GC_INCREMENTAL
+    enum IncrementalPhase { IncrementalIdle, IncrementalMarking, IncrementalSweeping };
+    
+    static const int MarkStackSize = 4096;
+    static const int IncrementalTriggerOops = 2048;
+    static const int IncrementalTriggerWords = 65536;
+    static const int IncrementalSliceObjects = 256; // between looks at the clock
+    
+    IncrementalPhase incrementalPhase;
+    std::uint32_t markBits[ObjectTableSize / 64 + 1];
+    int markStack[MarkStackSize];
+    int markStackCount;
+    bool markStackOverflowed;   // marked objects may have unmarked fields
+    int sweepPointer;
+    int oopsAfterLastCycle;
+    int wordsAfterLastCycle;
+    std::uint32_t incrementalCycleCount;
+    std::uint32_t incrementalFreed;
+    
+    inline void grayObject(int objectPointer)
+    {
+        if (isIntegerObject(objectPointer) || testBit(markBits, objectPointer))
+            return;
+        setBit(markBits, objectPointer);
+        if (markStackCount < MarkStackSize)
+            markStack[markStackCount++] = objectPointer;
+        else
+            markStackOverflowed = true;
+    }
+    
+    // Objects allocated during a cycle are black. Behind the sweep they stay
+    // unmarked, garbage still holding the oop from a swept object must not
+    // count them down.
+    inline void allocatedDuringCycle(int objectPointer)
+    {
+        if (incrementalPhase == IncrementalMarking ||
+            (incrementalPhase == IncrementalSweeping && objectPointer >= sweepPointer))
+            setBit(markBits, objectPointer);
+        else
+            clearBit(markBits, objectPointer);
+    }
+    
+    void startIncrementalCycle();
+    void scanGrayObject(int objectPointer);
+    // Each return true when the phase is done
+    bool incrementalMark(int limit);
+    bool incrementalSweep(int limit);
+    void finishIncrementalMarking();
+#endif
+    
     bool loadObjectTable( IFileSystem *fileSystem, int fd);
-    static bool padToPage(IFileSystem *fileSystem, int fd);
     bool loadObjects(IFileSystem *fileSystem, int fd);
-    bool saveObjects(IFileSystem *fileSystem, int fd);
+    bool saveObjects();
+    
+    // Snapshots are written through a buffer, in cluster sized pieces
+    static const int SnapshotBufferSize = 32768;
+    static const int SnapshotProgressInterval = 262144;
+    
+    std::uint8_t snapshotBuffer[SnapshotBufferSize];
+    int snapshotBufferCount;
+    int snapshotPosition;       // bytes written to the snapshot so far
+    int snapshotFileLength;     // ... and to the file, less if compressed
+    std::uint32_t snapshotChecksum;
+    IFileSystem *snapshotFileSystem;
+    int snapshotFile;
+    
+    bool snapshotWrite(const void *data, int bytes);
+    bool snapshotFlush();
+    bool snapshotFileWrite(const std::uint8_t *bytes, int count);
+    bool padToPage();
+    void startSnapshotFile(IFileSystem *fileSystem, int fd);
+    
+#ifdef COMPRESSED_SNAPSHOTS
+    // Each buffer full is compressed by itself, see compressSnapshotBlock
+    std::uint8_t compressedBuffer[SnapshotBufferSize];
+    std::int32_t compressionPositions[4096];
+#endif
+    
+    // Read the snapshot back, it must match the length and checksum written
+    bool verifySnapshot(IFileSystem *fileSystem, const char *fileName);
+    static const std::uint32_t SnapshotChecksumSeed = 2166136261u;
+    static std::uint32_t checksumOf(const std::uint8_t *bytes, int count, std::uint32_t checksum);
+    // ... of a file from the current position to the end
+    bool checksumOfFile(IFileSystem *fileSystem, int fd, std::uint32_t *checksum);
+    
+#ifdef DELTA_SNAPSHOTS
+    // The base snapshot is the one loaded or last saved in full. Its object
+    // table entries are kept as in the image (without the segment), objects
+    // are looked at if their chunk is on a dirty heap page or their oop was
+    // changed by become: or by the delta merged when loading.
+    static const int DirtyPageShift = 8;    // 256 word pages
+    static const int DirtyPageCount = RealWordMemory::SegmentCount * RealWordMemory::SegmentSize >> DirtyPageShift;
+    static const int FreeEntryInImage = 0x0020; // free bit only, see saveObjects
+    static const int SegmentBitsInImage = 0x000f;
+    
+    std::uint16_t *heapBase;
+    std::uint32_t dirtyPages[DirtyPageCount / 32];
+    std::uint32_t changedObjects[ObjectTableSize / 64 + 1];
+    std::uint16_t baseObjectTable[ObjectTableSize / 2];
+    int baseLength;             // of the base snapshot file, 0 if not known
+    std::uint32_t baseChecksum; // ... and its checksum
+    
+    inline void markPageDirty(const void *address)
+    {
+        int page = (int) ((const std::uint8_t *) address - (const std::uint8_t *) heapBase) >> (DirtyPageShift + 1);
+        dirtyPages[page >> 5] |= 1u << (page & 31);
+    }
+    
+    // The first word of an object table entry as saved, see saveObjects
+    int imageEntryOf(int objectPointer);
+    bool isChunkDirty(int objectPointer);
+    // The current state becomes the base
+    void resetDeltaBaseline();
+    // Merge the delta into the image loaded, false if it does not belong to it
+    bool mergeDeltaSnapshot(IFileSystem *fileSystem, int fd);
+    bool saveChangedObjects(int &records, int &objects);
+#endif
 
 #ifdef GC_MARK_SWEEP
     IGCNotification *gcNotification;
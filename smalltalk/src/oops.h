@@ -60,6 +60,7 @@ static const int ClassFloatPointer = 20;
 static const int ClassSemaphorePointer = 38;
 static const int ClassDisplayScreenPointer = 834;
 static const int ClassUndefinedObject = 25728; 
+static const int ClassLargeNegativeIntegerPointer = 7584;
 
 // Selectors
 static const int DoesNotUnderstandSelector = 42;
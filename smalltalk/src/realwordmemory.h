@@ -31,11 +31,22 @@
 #include <cstdint>
 #include <cassert>
 
+// Use 64 segments (8 MB) instead of the 16 of G&R. The object table entry of
+// G&R only has room for 16 segments, so this needs NATIVE_OBJECT_TABLE (see
+// objmemory.h), and snapshots can only be saved while the objects fit into 16.
+#define EXTENDED_OBJECT_MEMORY
+
 // Segmented Memory Model as described in G&R pg. 656
 class RealWordMemory
 {
 public:
+#ifdef EXTENDED_OBJECT_MEMORY
+    static const int SegmentCount = 64;
+#else
     static const int SegmentCount = 16;
+#endif
+    // The number of segments a snapshot can address
+    static const int ImageSegmentCount = 16;
     static const int SegmentSize = 65536; /* in words */
     
     RealWordMemory()
@@ -58,6 +69,14 @@ public:
         return value;
     }
     
+    // Address of a word, for callers that walk objects directly
+    inline std::uint16_t *segment_word_address(int s, int w)
+    {
+        assert(s >= 0 && s < SegmentCount);
+        assert(w >= 0 && w < SegmentSize);
+        return &memory[s][w];
+    }
+    
     inline int segment_word_byte(int s, int w, int byteNumber)
     {
         assert(s >= 0 && s < SegmentCount);
@@ -571,9 +571,13 @@ static inline void expand_pixel(Pixel *destPixel, std::uint16_t srcWord, int src
             check_scheduled_semaphore();
             interpreter.checkLowMemoryConditions();
 
-            for(int i = 0; i < vm_options.cycles_per_frame && !quit_signalled; i++)
+            if (!quit_signalled)
             {
-                interpreter.cycle();
+                interpreter.runSlice(vm_options.cycles_per_frame);
+#ifdef GC_INCREMENTAL
+                if (vm_options.gc_pause > 0)
+                    interpreter.collectGarbageIncrementally(vm_options.gc_pause);
+#endif
             }
 
             if (quit_signalled) break;
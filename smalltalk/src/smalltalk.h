@@ -71,6 +71,7 @@ struct options
     int         display_scale;
     bool        vsync;
     uint32_t    novsync_delay;
+    uint32_t    gc_pause;           // ms per frame for the incremental collector, 0 for none
 };
 
 class VirtualMachine: public IHardwareAbstractionLayer